@@ -6,6 +6,8 @@
 #define BVH_AABB_H
 
 #include <algorithm>
+#include <limits>
+#include <vector>
 
 #include "triangle.h"
 
@@ -29,13 +31,78 @@ public:
         }
     }
 
-    static aabb from_triangle(const triangle& tri) {
-        vector3 min_corner{std::min(tri.vertex(0).data[0], std::min(tri.vertex(1).data[0], tri.vertex(2).data[0])),
-                           std::min(tri.vertex(0).data[1], std::min(tri.vertex(1).data[1], tri.vertex(2).data[1])),
-                           std::min(tri.vertex(0).data[2], std::min(tri.vertex(1).data[2], tri.vertex(2).data[2]))};
-        vector3 max_corner{std::max(tri.vertex(0).data[0], std::max(tri.vertex(1).data[0], tri.vertex(2).data[0])),
-                           std::max(tri.vertex(0).data[1], std::max(tri.vertex(1).data[1], tri.vertex(2).data[1])),
-                           std::max(tri.vertex(0).data[2], std::max(tri.vertex(1).data[2], tri.vertex(2).data[2]))};
+    // Box that contains nothing; merging it with any other box yields that box
+    static aabb empty() {
+        float inf = std::numeric_limits<float>::infinity();
+        return aabb{vector3{inf, inf, inf}, vector3{-inf, -inf, -inf}};
+    }
+
+    bool is_empty() const {
+        return min_corner.data[0] > max_corner.data[0] ||
+               min_corner.data[1] > max_corner.data[1] ||
+               min_corner.data[2] > max_corner.data[2];
+    }
+
+    vector3 centroid() const {
+        return min_corner * 0.5f + max_corner * 0.5f;
+    }
+
+    float surface_area() const {
+        if (is_empty()) {
+            return 0.0f;
+        }
+        vector3 d = max_corner - min_corner;
+        return 2.0f * (d.data[0] * d.data[1] + d.data[1] * d.data[2] + d.data[2] * d.data[0]);
+    }
+
+    void expand(const vector3& point) {
+        for (int axis = 0; axis < 3; axis++) {
+            min_corner.data[axis] = std::min(min_corner.data[axis], point.data[axis]);
+            max_corner.data[axis] = std::max(max_corner.data[axis], point.data[axis]);
+        }
+    }
+
+    // Slab test against a ray given by its origin and 1 / direction. Flat boxes still count as hit.
+    bool intersect(const vector3& origin, const vector3& inv_direction, float tmin, float tmax, float& t_near) const {
+        for (int axis = 0; axis < 3; axis++) {
+            float t0 = (min_corner.data[axis] - origin.data[axis]) * inv_direction.data[axis];
+            float t1 = (max_corner.data[axis] - origin.data[axis]) * inv_direction.data[axis];
+            if (inv_direction.data[axis] < 0.0f) {
+                std::swap(t0, t1);
+            }
+
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+
+            if (tmax < tmin) {
+                return false;
+            }
+        }
+        t_near = tmin;
+        return true;
+    }
+
+    static aabb from_triangle(const triangle& tri, const std::vector<vector3>& vertices) {
+        const vector3& v0 = vertices[tri.vertices_ids[0]];
+        const vector3& v1 = vertices[tri.vertices_ids[1]];
+        const vector3& v2 = vertices[tri.vertices_ids[2]];
+        vector3 min_corner{std::min(v0.data[0], std::min(v1.data[0], v2.data[0])),
+                           std::min(v0.data[1], std::min(v1.data[1], v2.data[1])),
+                           std::min(v0.data[2], std::min(v1.data[2], v2.data[2]))};
+        vector3 max_corner{std::max(v0.data[0], std::max(v1.data[0], v2.data[0])),
+                           std::max(v0.data[1], std::max(v1.data[1], v2.data[1])),
+                           std::max(v0.data[2], std::max(v1.data[2], v2.data[2]))};
+        return aabb{min_corner, max_corner};
+    }
+
+    // Overlap of two boxes, empty when they do not touch
+    static aabb intersection(const aabb& box0, const aabb& box1) {
+        vector3 min_corner{std::max(box0.min_corner.data[0], box1.min_corner.data[0]),
+                           std::max(box0.min_corner.data[1], box1.min_corner.data[1]),
+                           std::max(box0.min_corner.data[2], box1.min_corner.data[2])};
+        vector3 max_corner{std::min(box0.max_corner.data[0], box1.max_corner.data[0]),
+                           std::min(box0.max_corner.data[1], box1.max_corner.data[1]),
+                           std::min(box0.max_corner.data[2], box1.max_corner.data[2])};
         return aabb{min_corner, max_corner};
     }
 
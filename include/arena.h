@@ -0,0 +1,158 @@
+//
+// Created by mykola on 18.05.24.
+//
+
+#ifndef BVH_ARENA_H
+#define BVH_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+// Bump allocator for build-time data. Objects are never freed one by one:
+// reset() rewinds the arena for the next build and release() returns the memory.
+class arena {
+    struct block {
+        unsigned char* data;
+        size_t size;
+    };
+
+    std::vector<block> m_blocks;
+    size_t m_current = 0;
+    size_t m_offset = 0;
+    size_t m_block_size;
+
+public:
+    explicit arena(size_t block_size = 256 * 1024): m_block_size(block_size) {}
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    arena(arena&& other) noexcept: m_blocks(std::move(other.m_blocks)), m_current(other.m_current),
+                                   m_offset(other.m_offset), m_block_size(other.m_block_size) {
+        other.m_blocks.clear();
+        other.reset();
+    }
+
+    arena& operator=(arena&& other) noexcept {
+        if (this != &other) {
+            release();
+            m_blocks = std::move(other.m_blocks);
+            m_current = other.m_current;
+            m_offset = other.m_offset;
+            m_block_size = other.m_block_size;
+            other.m_blocks.clear();
+            other.reset();
+        }
+        return *this;
+    }
+
+    ~arena() {
+        release();
+    }
+
+    void* allocate_bytes(size_t size, size_t alignment) {
+        while (m_current < m_blocks.size()) {
+            block& b = m_blocks[m_current];
+            size_t offset = align_up(reinterpret_cast<uintptr_t>(b.data) + m_offset, alignment) - reinterpret_cast<uintptr_t>(b.data);
+            if (offset + size <= b.size) {
+                m_offset = offset + size;
+                return b.data + offset;
+            }
+            m_current++;
+            m_offset = 0;
+        }
+
+        block b;
+        b.size = std::max(m_block_size, size + alignment);
+        b.data = static_cast<unsigned char*>(std::malloc(b.size));
+        if (b.data == nullptr) {
+            throw std::bad_alloc();
+        }
+        m_blocks.push_back(b);
+        m_current = m_blocks.size() - 1;
+        m_offset = 0;
+        return allocate_bytes(size, alignment);
+    }
+
+    // Storage for count default-constructed objects. Destructors are never run.
+    template <typename T>
+    T* allocate(size_t count = 1) {
+        T* data = static_cast<T*>(allocate_bytes(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; i++) {
+            new (data + i) T();
+        }
+        return data;
+    }
+
+    // Keep the blocks but make all of them available again
+    void reset() {
+        m_current = 0;
+        m_offset = 0;
+    }
+
+    void release() {
+        for (auto& b : m_blocks) {
+            std::free(b.data);
+        }
+        m_blocks.clear();
+        reset();
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& b : m_blocks) {
+            total += b.size;
+        }
+        return total;
+    }
+
+private:
+    static uintptr_t align_up(uintptr_t value, size_t alignment) {
+        return (value + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+    }
+};
+
+// std::vector allocator for over-aligned element types (C++11 new only guarantees alignof(max_align_t))
+template <typename T, size_t Alignment>
+struct aligned_allocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = aligned_allocator<U, Alignment>;
+    };
+
+    aligned_allocator() = default;
+
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+    T* allocate(size_t count) {
+        void* data = nullptr;
+        if (posix_memalign(&data, Alignment, std::max<size_t>(count * sizeof(T), 1)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(data);
+    }
+
+    void deallocate(T* data, size_t) {
+        std::free(data);
+    }
+
+    template <typename U>
+    bool operator==(const aligned_allocator<U, Alignment>&) const {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const aligned_allocator<U, Alignment>&) const {
+        return false;
+    }
+};
+
+#endif //BVH_ARENA_H
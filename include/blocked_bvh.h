@@ -0,0 +1,851 @@
+//
+// Created by mykola on 06.06.24.
+//
+
+#ifndef BVH_BLOCKED_BVH_H
+#define BVH_BLOCKED_BVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.h"
+#include "cpu_features.h"
+#include "ray_packet.h"
+#include "simd_vector3.h"
+
+// Triangles of one leaf, pre-transformed for Moller-Trumbore and stored as structure of arrays
+// so one SSE (Width = 4) or AVX (Width = 8) pass tests all of them. Unused lanes have zero
+// edges, their determinant is 0 and they never hit.
+template <int Width>
+struct alignas(32) triangle_block {
+    static const int width = Width;
+    using ray_type = ray;   // what the kernel takes per ray
+
+    float v0[3][Width];
+    float e1[3][Width];     // v1 - v0
+    float e2[3][Width];     // v2 - v0
+    uint32_t triangle[Width];   // index into scene::get_triangles()
+
+    static triangle_block empty() {
+        return triangle_block{};
+    }
+
+    void set(int lane, const vector3& a, const vector3& b, const vector3& c, uint32_t index) {
+        vector3 edge1 = b - a;
+        vector3 edge2 = c - a;
+        for (int axis = 0; axis < 3; axis++) {
+            v0[axis][lane] = a.data[axis];
+            e1[axis][lane] = edge1.data[axis];
+            e2[axis][lane] = edge2.data[axis];
+        }
+        triangle[lane] = index;
+    }
+};
+
+// Triangles of one leaf for the watertight test. It needs the vertices themselves: edges rounded
+// differently in the two triangles of a shared edge would open cracks. Unused lanes are NaN and never hit.
+template <int Width>
+struct alignas(32) watertight_block {
+    static const int width = Width;
+    using ray_type = watertight_ray;
+
+    float v0[3][Width];
+    float v1[3][Width];
+    float v2[3][Width];
+    uint32_t triangle[Width];
+
+    static watertight_block empty() {
+        watertight_block block{};
+        float nan = std::numeric_limits<float>::quiet_NaN();
+        std::fill(&block.v0[0][0], &block.v0[0][0] + 3 * Width, nan);
+        std::fill(&block.v1[0][0], &block.v1[0][0] + 3 * Width, nan);
+        std::fill(&block.v2[0][0], &block.v2[0][0] + 3 * Width, nan);
+        return block;
+    }
+
+    void set(int lane, const vector3& a, const vector3& b, const vector3& c, uint32_t index) {
+        for (int axis = 0; axis < 3; axis++) {
+            v0[axis][lane] = a.data[axis];
+            v1[axis][lane] = b.data[axis];
+            v2[axis][lane] = c.data[axis];
+        }
+        triangle[lane] = index;
+    }
+};
+
+template <class Block>
+using block_array = std::vector<Block, aligned_allocator<Block, 32>>;
+
+template <int Width>
+using triangle_block_array = block_array<triangle_block<Width>>;
+
+template <int Width>
+using watertight_block_array = block_array<watertight_block<Width>>;
+
+namespace blocked_bvh_detail {
+
+const float determinant_epsilon = 1e-8f;     // same as intersect_triangle()
+
+// Picks the closest of the lanes in mask, lower lanes win ties like the scalar loop
+inline int closest_lane(unsigned mask, const float* t, const float* u, const float* v,
+                        float& t_out, float& u_out, float& v_out) {
+    int lane = -1;
+    for (int i = 0; mask != 0; i++, mask >>= 1) {
+        if ((mask & 1u) && (lane < 0 || t[i] < t_out)) {
+            lane = i;
+            t_out = t[i];
+            u_out = u[i];
+            v_out = v[i];
+        }
+    }
+    return lane;
+}
+
+// Reference kernel, used for any width the CPU has no SIMD path for
+template <int Width>
+inline int intersect_block_scalar(const triangle_block<Width>& block, const ray& r, float tmax,
+                                  float& t_out, float& u_out, float& v_out) {
+    int lane = -1;
+    for (int i = 0; i < Width; i++) {
+        vector3 e1{block.e1[0][i], block.e1[1][i], block.e1[2][i]};
+        vector3 e2{block.e2[0][i], block.e2[1][i], block.e2[2][i]};
+        vector3 h = r.direction.cross(e2);
+        float a = e1.dot(h);
+        if (a > -determinant_epsilon && a < determinant_epsilon) {
+            continue;
+        }
+
+        float f = 1.0f / a;
+        vector3 s = r.origin - vector3{block.v0[0][i], block.v0[1][i], block.v0[2][i]};
+        float u = s.dot(h) * f;
+        if (u < 0.0f || u > 1.0f) {
+            continue;
+        }
+
+        vector3 q = s.cross(e1);
+        float v = r.direction.dot(q) * f;
+        if (v < 0.0f || u + v > 1.0f) {
+            continue;
+        }
+
+        float t = e2.dot(q) * f;
+        if (t > r.tmin && t < tmax) {
+            tmax = t;
+            lane = i;
+            t_out = t;
+            u_out = u;
+            v_out = v;
+        }
+    }
+    return lane;
+}
+
+#if defined(BVH_X86)
+// Same arithmetic in the same order as intersect_triangle(), so hits match it bit for bit
+inline int intersect_block_4_sse(const triangle_block<4>& block, const ray& r, float tmax,
+                                 float& t_out, float& u_out, float& v_out) {
+    __m128 dx = _mm_set1_ps(r.direction.data[0]);
+    __m128 dy = _mm_set1_ps(r.direction.data[1]);
+    __m128 dz = _mm_set1_ps(r.direction.data[2]);
+    __m128 e1x = _mm_load_ps(block.e1[0]);
+    __m128 e1y = _mm_load_ps(block.e1[1]);
+    __m128 e1z = _mm_load_ps(block.e1[2]);
+    __m128 e2x = _mm_load_ps(block.e2[0]);
+    __m128 e2y = _mm_load_ps(block.e2[1]);
+    __m128 e2z = _mm_load_ps(block.e2[2]);
+
+    __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+    __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(r.origin.data[0]), _mm_load_ps(block.v0[0]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(r.origin.data[1]), _mm_load_ps(block.v0[1]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(r.origin.data[2]), _mm_load_ps(block.v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)), f);
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), f);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), f);
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 epsilon = _mm_set1_ps(determinant_epsilon);
+    __m128 mask = _mm_or_ps(_mm_cmple_ps(a, _mm_sub_ps(zero, epsilon)), _mm_cmpge_ps(a, epsilon));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(r.tmin)), _mm_cmplt_ps(t, _mm_set1_ps(tmax))));
+
+    unsigned bits = static_cast<unsigned>(_mm_movemask_ps(mask));
+    if (bits == 0) {
+        return -1;
+    }
+    alignas(16) float ts[4], us[4], vs[4];
+    _mm_store_ps(ts, t);
+    _mm_store_ps(us, u);
+    _mm_store_ps(vs, v);
+    return closest_lane(bits, ts, us, vs, t_out, u_out, v_out);
+}
+
+BVH_TARGET_AVX
+inline int intersect_block_8_avx(const triangle_block<8>& block, const ray& r, float tmax,
+                                 float& t_out, float& u_out, float& v_out) {
+    __m256 dx = _mm256_set1_ps(r.direction.data[0]);
+    __m256 dy = _mm256_set1_ps(r.direction.data[1]);
+    __m256 dz = _mm256_set1_ps(r.direction.data[2]);
+    __m256 e1x = _mm256_load_ps(block.e1[0]);
+    __m256 e1y = _mm256_load_ps(block.e1[1]);
+    __m256 e1z = _mm256_load_ps(block.e1[2]);
+    __m256 e2x = _mm256_load_ps(block.e2[0]);
+    __m256 e2y = _mm256_load_ps(block.e2[1]);
+    __m256 e2z = _mm256_load_ps(block.e2[2]);
+
+    __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+    __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(r.origin.data[0]), _mm256_load_ps(block.v0[0]));
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(r.origin.data[1]), _mm256_load_ps(block.v0[1]));
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(r.origin.data[2]), _mm256_load_ps(block.v0[2]));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)),
+                                           _mm256_mul_ps(sz, hz)), f);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                                           _mm256_mul_ps(dz, qz)), f);
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                                           _mm256_mul_ps(e2z, qz)), f);
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 epsilon = _mm256_set1_ps(determinant_epsilon);
+    __m256 mask = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_sub_ps(zero, epsilon), _CMP_LE_OQ),
+                               _mm256_cmp_ps(a, epsilon, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+                                             _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+    mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(r.tmin), _CMP_GT_OQ),
+                                             _mm256_cmp_ps(t, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+
+    unsigned bits = static_cast<unsigned>(_mm256_movemask_ps(mask));
+    if (bits == 0) {
+        return -1;
+    }
+    alignas(32) float ts[8], us[8], vs[8];
+    _mm256_store_ps(ts, t);
+    _mm256_store_ps(us, u);
+    _mm256_store_ps(vs, v);
+    return closest_lane(bits, ts, us, vs, t_out, u_out, v_out);
+}
+#endif
+
+inline int intersect_block(const triangle_block<4>& block, const ray& r, float tmax, float& t, float& u, float& v) {
+#if defined(BVH_X86)
+    return intersect_block_4_sse(block, r, tmax, t, u, v);
+#else
+    return intersect_block_scalar(block, r, tmax, t, u, v);
+#endif
+}
+
+inline int intersect_block(const triangle_block<8>& block, const ray& r, float tmax, float& t, float& u, float& v) {
+#if defined(BVH_X86)
+    if (cpu_features::get().avx) {
+        return intersect_block_8_avx(block, r, tmax, t, u, v);
+    }
+#endif
+    return intersect_block_scalar(block, r, tmax, t, u, v);
+}
+
+template <int Width>
+inline int intersect_block_scalar(const watertight_block<Width>& block, const watertight_ray& r, float tmax,
+                                  float& t_out, float& u_out, float& v_out) {
+    int lane = -1;
+    for (int i = 0; i < Width; i++) {
+        float t, u, v;
+        if (intersect_triangle_watertight(r, vector3{block.v0[0][i], block.v0[1][i], block.v0[2][i]},
+                                          vector3{block.v1[0][i], block.v1[1][i], block.v1[2][i]},
+                                          vector3{block.v2[0][i], block.v2[1][i], block.v2[2][i]}, tmax, t, u, v)) {
+            tmax = t;
+            lane = i;
+            t_out = t;
+            u_out = u;
+            v_out = v;
+        }
+    }
+    return lane;
+}
+
+// Redoes the edge functions of the given lanes in double, see watertight_edge_functions()
+template <int Width>
+inline void refine_edge_functions(unsigned lanes, const float (&sheared)[6][Width], float* eu, float* ev, float* ew) {
+    for (int i = 0; lanes != 0; i++, lanes >>= 1) {
+        if (lanes & 1u) {
+            watertight_edge_functions(sheared[0][i], sheared[1][i], sheared[2][i], sheared[3][i], sheared[4][i],
+                                      sheared[5][i], eu[i], ev[i], ew[i]);
+        }
+    }
+}
+
+#if defined(BVH_X86)
+// Same arithmetic in the same order as intersect_triangle_watertight(), so hits match it bit for bit
+inline int intersect_block_4_sse(const watertight_block<4>& block, const watertight_ray& r, float tmax,
+                                 float& t_out, float& u_out, float& v_out) {
+    __m128 ox = _mm_set1_ps(r.origin.data[r.kx]);
+    __m128 oy = _mm_set1_ps(r.origin.data[r.ky]);
+    __m128 oz = _mm_set1_ps(r.origin.data[r.kz]);
+    __m128 sx = _mm_set1_ps(r.sx);
+    __m128 sy = _mm_set1_ps(r.sy);
+    __m128 sz = _mm_set1_ps(r.sz);
+
+    // Vertices relative to the origin, permuted so z is the major axis of the direction
+    __m128 az = _mm_sub_ps(_mm_load_ps(block.v0[r.kz]), oz);
+    __m128 bz = _mm_sub_ps(_mm_load_ps(block.v1[r.kz]), oz);
+    __m128 cz = _mm_sub_ps(_mm_load_ps(block.v2[r.kz]), oz);
+    __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v0[r.kx]), ox), _mm_mul_ps(sx, az));
+    __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v0[r.ky]), oy), _mm_mul_ps(sy, az));
+    __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v1[r.kx]), ox), _mm_mul_ps(sx, bz));
+    __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v1[r.ky]), oy), _mm_mul_ps(sy, bz));
+    __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v2[r.kx]), ox), _mm_mul_ps(sx, cz));
+    __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v2[r.ky]), oy), _mm_mul_ps(sy, cz));
+
+    __m128 eu = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 ev = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 ew = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+    __m128 zero = _mm_setzero_ps();
+    unsigned on_edge = static_cast<unsigned>(_mm_movemask_ps(_mm_or_ps(
+            _mm_or_ps(_mm_cmpeq_ps(eu, zero), _mm_cmpeq_ps(ev, zero)), _mm_cmpeq_ps(ew, zero))));
+    if (on_edge != 0) {
+        alignas(16) float sheared[6][4];
+        alignas(16) float us[4], vs[4], ws[4];
+        _mm_store_ps(sheared[0], ax);
+        _mm_store_ps(sheared[1], ay);
+        _mm_store_ps(sheared[2], bx);
+        _mm_store_ps(sheared[3], by);
+        _mm_store_ps(sheared[4], cx);
+        _mm_store_ps(sheared[5], cy);
+        _mm_store_ps(us, eu);
+        _mm_store_ps(vs, ev);
+        _mm_store_ps(ws, ew);
+        refine_edge_functions(on_edge, sheared, us, vs, ws);
+        eu = _mm_load_ps(us);
+        ev = _mm_load_ps(vs);
+        ew = _mm_load_ps(ws);
+    }
+
+    __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(eu, zero), _mm_cmplt_ps(ev, zero)), _mm_cmplt_ps(ew, zero));
+    __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(eu, zero), _mm_cmpgt_ps(ev, zero)), _mm_cmpgt_ps(ew, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(eu, ev), ew);
+    __m128 scaled_t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(eu, _mm_mul_ps(sz, az)), _mm_mul_ps(ev, _mm_mul_ps(sz, bz))),
+                                 _mm_mul_ps(ew, _mm_mul_ps(sz, cz)));
+
+    // Flip everything to a positive determinant
+    __m128 sign = _mm_and_ps(det, _mm_set1_ps(-0.0f));
+    det = _mm_xor_ps(det, sign);
+    scaled_t = _mm_xor_ps(scaled_t, sign);
+
+    __m128 mask = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpgt_ps(det, zero));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(scaled_t, _mm_mul_ps(_mm_set1_ps(r.tmin), det)),
+                                       _mm_cmplt_ps(scaled_t, _mm_mul_ps(_mm_set1_ps(tmax), det))));
+
+    unsigned bits = static_cast<unsigned>(_mm_movemask_ps(mask));
+    if (bits == 0) {
+        return -1;
+    }
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    alignas(16) float ts[4], us[4], vs[4];
+    _mm_store_ps(ts, _mm_mul_ps(scaled_t, inv_det));
+    _mm_store_ps(us, _mm_mul_ps(_mm_xor_ps(ev, sign), inv_det));
+    _mm_store_ps(vs, _mm_mul_ps(_mm_xor_ps(ew, sign), inv_det));
+    return closest_lane(bits, ts, us, vs, t_out, u_out, v_out);
+}
+
+BVH_TARGET_AVX
+inline int intersect_block_8_avx(const watertight_block<8>& block, const watertight_ray& r, float tmax,
+                                 float& t_out, float& u_out, float& v_out) {
+    __m256 ox = _mm256_set1_ps(r.origin.data[r.kx]);
+    __m256 oy = _mm256_set1_ps(r.origin.data[r.ky]);
+    __m256 oz = _mm256_set1_ps(r.origin.data[r.kz]);
+    __m256 sx = _mm256_set1_ps(r.sx);
+    __m256 sy = _mm256_set1_ps(r.sy);
+    __m256 sz = _mm256_set1_ps(r.sz);
+
+    __m256 az = _mm256_sub_ps(_mm256_load_ps(block.v0[r.kz]), oz);
+    __m256 bz = _mm256_sub_ps(_mm256_load_ps(block.v1[r.kz]), oz);
+    __m256 cz = _mm256_sub_ps(_mm256_load_ps(block.v2[r.kz]), oz);
+    __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v0[r.kx]), ox), _mm256_mul_ps(sx, az));
+    __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v0[r.ky]), oy), _mm256_mul_ps(sy, az));
+    __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v1[r.kx]), ox), _mm256_mul_ps(sx, bz));
+    __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v1[r.ky]), oy), _mm256_mul_ps(sy, bz));
+    __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v2[r.kx]), ox), _mm256_mul_ps(sx, cz));
+    __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v2[r.ky]), oy), _mm256_mul_ps(sy, cz));
+
+    __m256 eu = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+    __m256 ev = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+    __m256 ew = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+    __m256 zero = _mm256_setzero_ps();
+    unsigned on_edge = static_cast<unsigned>(_mm256_movemask_ps(_mm256_or_ps(
+            _mm256_or_ps(_mm256_cmp_ps(eu, zero, _CMP_EQ_OQ), _mm256_cmp_ps(ev, zero, _CMP_EQ_OQ)),
+            _mm256_cmp_ps(ew, zero, _CMP_EQ_OQ))));
+    if (on_edge != 0) {
+        alignas(32) float sheared[6][8];
+        alignas(32) float us[8], vs[8], ws[8];
+        _mm256_store_ps(sheared[0], ax);
+        _mm256_store_ps(sheared[1], ay);
+        _mm256_store_ps(sheared[2], bx);
+        _mm256_store_ps(sheared[3], by);
+        _mm256_store_ps(sheared[4], cx);
+        _mm256_store_ps(sheared[5], cy);
+        _mm256_store_ps(us, eu);
+        _mm256_store_ps(vs, ev);
+        _mm256_store_ps(ws, ew);
+        refine_edge_functions(on_edge, sheared, us, vs, ws);
+        eu = _mm256_load_ps(us);
+        ev = _mm256_load_ps(vs);
+        ew = _mm256_load_ps(ws);
+    }
+
+    __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(eu, zero, _CMP_LT_OQ), _mm256_cmp_ps(ev, zero, _CMP_LT_OQ)),
+                                   _mm256_cmp_ps(ew, zero, _CMP_LT_OQ));
+    __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(eu, zero, _CMP_GT_OQ), _mm256_cmp_ps(ev, zero, _CMP_GT_OQ)),
+                                   _mm256_cmp_ps(ew, zero, _CMP_GT_OQ));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(eu, ev), ew);
+    __m256 scaled_t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(eu, _mm256_mul_ps(sz, az)),
+                                                  _mm256_mul_ps(ev, _mm256_mul_ps(sz, bz))),
+                                    _mm256_mul_ps(ew, _mm256_mul_ps(sz, cz)));
+
+    __m256 sign = _mm256_and_ps(det, _mm256_set1_ps(-0.0f));
+    det = _mm256_xor_ps(det, sign);
+    scaled_t = _mm256_xor_ps(scaled_t, sign);
+
+    __m256 mask = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(det, zero, _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_and_ps(
+            _mm256_cmp_ps(scaled_t, _mm256_mul_ps(_mm256_set1_ps(r.tmin), det), _CMP_GT_OQ),
+            _mm256_cmp_ps(scaled_t, _mm256_mul_ps(_mm256_set1_ps(tmax), det), _CMP_LT_OQ)));
+
+    unsigned bits = static_cast<unsigned>(_mm256_movemask_ps(mask));
+    if (bits == 0) {
+        return -1;
+    }
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    alignas(32) float ts[8], us[8], vs[8];
+    _mm256_store_ps(ts, _mm256_mul_ps(scaled_t, inv_det));
+    _mm256_store_ps(us, _mm256_mul_ps(_mm256_xor_ps(ev, sign), inv_det));
+    _mm256_store_ps(vs, _mm256_mul_ps(_mm256_xor_ps(ew, sign), inv_det));
+    return closest_lane(bits, ts, us, vs, t_out, u_out, v_out);
+}
+#endif
+
+inline int intersect_block(const watertight_block<4>& block, const watertight_ray& r, float tmax,
+                           float& t, float& u, float& v) {
+#if defined(BVH_X86)
+    return intersect_block_4_sse(block, r, tmax, t, u, v);
+#else
+    return intersect_block_scalar(block, r, tmax, t, u, v);
+#endif
+}
+
+inline int intersect_block(const watertight_block<8>& block, const watertight_ray& r, float tmax,
+                           float& t, float& u, float& v) {
+#if defined(BVH_X86)
+    if (cpu_features::get().avx) {
+        return intersect_block_8_avx(block, r, tmax, t, u, v);
+    }
+#endif
+    return intersect_block_scalar(block, r, tmax, t, u, v);
+}
+
+// Ray prepared for intersect_node(). 1 / direction comes from the fast SSE reciprocal, the padding
+// lane is NaN so it drops out of the min / max reductions.
+struct slab_ray {
+    simd_vector3 origin;
+    simd_vector3 inv_direction;
+
+    explicit slab_ray(const ray& r): origin(r.origin), inv_direction(simd_vector3(r.direction).reciprocal()) {
+        inv_direction.data[3] = std::numeric_limits<float>::quiet_NaN();
+    }
+};
+
+// The reciprocal is a few ulp off 1 / d, the exit distance is widened by this much so that
+// no box hit by the exact slab test is culled
+const float slab_tolerance = 1.0f / (1 << 20);
+
+// Pop-time cull of a stacked node whose t_near came from intersect_node(): the rcp error can push t_near
+// slightly past the closest hit, so it is compared with the same tolerance as the exit distance
+inline bool beyond(float t_near, float tmax) {
+    return t_near > tmax + std::fabs(tmax) * slab_tolerance;
+}
+
+// aabb::intersect() on the node corners with one SSE slab test. The corners are loaded straight
+// from the 32-byte node, lane 3 holds offset / count and is masked by the NaN in inv_direction.
+inline bool intersect_node(const linear_bvh_node& node, const slab_ray& r, float tmin, float tmax, float& t_near) {
+#if defined(BVH_X86)
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_corner.data), r.origin.m), r.inv_direction.m);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_corner.data), r.origin.m), r.inv_direction.m);
+    __m128 negative = _mm_cmplt_ps(r.inv_direction.m, _mm_setzero_ps());
+    __m128 t_entry = _mm_or_ps(_mm_and_ps(negative, t1), _mm_andnot_ps(negative, t0));
+    __m128 t_exit = _mm_or_ps(_mm_and_ps(negative, t0), _mm_andnot_ps(negative, t1));
+
+    // NaN lanes (the padding, or 0 * inf for an origin on a slab plane) give the second operand
+    __m128 lo = _mm_max_ps(t_entry, _mm_set1_ps(tmin));
+    __m128 hi = _mm_min_ps(t_exit, _mm_set1_ps(tmax));
+    lo = _mm_max_ps(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_min_ps(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    lo = _mm_max_ps(lo, _mm_movehl_ps(lo, lo));
+    hi = _mm_min_ps(hi, _mm_movehl_ps(hi, hi));
+
+    float t_lower = _mm_cvtss_f32(lo);
+    float t_upper = _mm_cvtss_f32(hi);
+    if (t_upper + std::fabs(t_upper) * slab_tolerance < t_lower) {
+        return false;
+    }
+    t_near = t_lower;
+    return true;
+#else
+    return node.box().intersect(r.origin.to_vector3(), r.inv_direction.to_vector3(), tmin, tmax, t_near);
+#endif
+}
+
+} // namespace blocked_bvh_detail
+
+// Binary bvh whose leaves are intersected as triangle_blocks instead of one indexed triangle at
+// a time. Width 0 picks 8-wide blocks when the CPU has AVX and 4-wide SSE blocks otherwise;
+// 8-wide blocks pay off with leaves of up to 8 triangles (bvh_build_options::max_leaf_size).
+// triangle_test::watertight stores watertight_blocks and uses the watertight test instead of Moller-Trumbore.
+// Nodes stay in the source bvh, which must outlive this object and not be rebuilt while it is in use.
+class blocked_bvh {
+    const bvh& m_source;
+    int m_width;
+    triangle_test m_test;
+    std::vector<uint32_t> m_first_block;    // per node, first block of a leaf
+    triangle_block_array<4> m_blocks4;
+    triangle_block_array<8> m_blocks8;
+    watertight_block_array<4> m_watertight4;
+    watertight_block_array<8> m_watertight8;
+
+    struct traversal_entry {
+        uint32_t node;
+        float t_near;
+    };
+
+    struct packet_entry {
+        uint32_t node;
+        int first;      // rays before this one missed an ancestor
+    };
+
+public:
+    explicit blocked_bvh(const bvh& source, int width = 0, triangle_test test = triangle_test::moller_trumbore)
+            : m_source(source), m_width(width), m_test(test) {
+        if (m_width == 0) {
+            m_width = cpu_features::get().avx ? 8 : 4;
+        }
+        if (m_width != 4 && m_width != 8) {
+            throw std::invalid_argument("blocked_bvh supports 4 and 8 wide blocks");
+        }
+        if (m_test == triangle_test::watertight && m_width == 8) {
+            build_blocks(m_watertight8);
+        } else if (m_test == triangle_test::watertight) {
+            build_blocks(m_watertight4);
+        } else if (m_width == 8) {
+            build_blocks(m_blocks8);
+        } else {
+            build_blocks(m_blocks4);
+        }
+    }
+
+    int width() const {
+        return m_width;
+    }
+
+    triangle_test test() const {
+        return m_test;
+    }
+
+    const bvh& source() const {
+        return m_source;
+    }
+
+    size_t memory_bytes() const {
+        return m_first_block.size() * sizeof(uint32_t) + m_blocks4.size() * sizeof(triangle_block<4>) +
+               m_blocks8.size() * sizeof(triangle_block<8>) + m_watertight4.size() * sizeof(watertight_block<4>) +
+               m_watertight8.size() * sizeof(watertight_block<8>);
+    }
+
+    // Closest hit in (r.tmin, r.tmax). With Moller-Trumbore the traversal order and results are
+    // those of bvh::intersect().
+    bool intersect(const ray& r, hit_record& hit) const {
+        if (m_test == triangle_test::watertight) {
+            return m_width == 8 ? intersect(r, hit, 0, m_watertight8) : intersect(r, hit, 0, m_watertight4);
+        }
+        return m_width == 8 ? intersect(r, hit, 0, m_blocks8) : intersect(r, hit, 0, m_blocks4);
+    }
+
+    // True if anything lies in (r.tmin, min(r.tmax, tmax)), see bvh::occluded()
+    bool occluded(const ray& r, float tmax) const {
+        if (m_test == triangle_test::watertight) {
+            return m_width == 8 ? occluded(r, tmax, m_watertight8) : occluded(r, tmax, m_watertight4);
+        }
+        return m_width == 8 ? occluded(r, tmax, m_blocks8) : occluded(r, tmax, m_blocks4);
+    }
+
+    // Closest hits of a whole packet, same results as tracing its rays one by one. Nodes are culled
+    // for the packet with interval arithmetic and entered for the rays from the first one that hits
+    // their box; once fewer than min_packet_rays rays are left the subtree is traced ray by ray.
+    // Packets with mixed direction signs are traced ray by ray from the start.
+    template <int Size>
+    void intersect(ray_packet<Size>& packet) const {
+        if (m_test == triangle_test::watertight && m_width == 8) {
+            intersect(packet, m_watertight8);
+        } else if (m_test == triangle_test::watertight) {
+            intersect(packet, m_watertight4);
+        } else if (m_width == 8) {
+            intersect(packet, m_blocks8);
+        } else {
+            intersect(packet, m_blocks4);
+        }
+    }
+
+    static const int min_packet_rays = 4;
+
+private:
+    template <class Block>
+    void build_blocks(block_array<Block>& blocks) {
+        const uint32_t width = Block::width;
+        const bvh_node_array& nodes = m_source.get();
+        const std::vector<triangle>& triangles = m_source.triangles();
+        const std::vector<vector3>& vertices = m_source.vertices();
+        const std::vector<uint32_t>& indices = m_source.indices();
+
+        m_first_block.assign(nodes.size(), 0);
+        for (size_t n = 0; n < nodes.size(); n++) {
+            if (!nodes[n].is_leaf()) {
+                continue;
+            }
+            m_first_block[n] = static_cast<uint32_t>(blocks.size());
+            for (uint32_t first = 0; first < nodes[n].count; first += width) {
+                Block block = Block::empty();
+                for (uint32_t lane = 0; lane < width && first + lane < nodes[n].count; lane++) {
+                    uint32_t entry = nodes[n].offset + first + lane;
+                    const triangle& tri = triangles[entry];
+                    block.set(lane, vertices[tri.vertices_ids[0]], vertices[tri.vertices_ids[1]],
+                              vertices[tri.vertices_ids[2]], indices[entry]);
+                }
+                blocks.push_back(block);
+            }
+        }
+    }
+
+    // Leaf triangles of node against r, shrinks tmax on a hit
+    template <class Block>
+    bool intersect_leaf(uint32_t node_index, const typename Block::ray_type& r, float& tmax, hit_record& hit,
+                        const block_array<Block>& blocks) const {
+        uint32_t first = m_first_block[node_index];
+        uint32_t last = first + (m_source.get()[node_index].count + Block::width - 1) / Block::width;
+        bool found = false;
+        for (uint32_t b = first; b < last; b++) {
+            float t, u, v;
+            int lane = blocked_bvh_detail::intersect_block(blocks[b], r, tmax, t, u, v);
+            if (lane >= 0) {
+                tmax = t;
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.triangle = blocks[b].triangle[lane];
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    template <class Block>
+    bool occluded(const ray& r, float tmax, const block_array<Block>& blocks) const {
+        const bvh_node_array& nodes = m_source.get();
+        blocked_bvh_detail::slab_ray slab(r);
+        typename Block::ray_type block_ray(r);
+        tmax = std::min(r.tmax, tmax);
+        float t_near;
+
+        uint32_t local_stack[bvh::traversal_stack_size];
+        std::vector<uint32_t> heap_stack;
+        uint32_t* stack = local_stack;
+        if (m_source.depth() >= bvh::traversal_stack_size) {
+            heap_stack.resize(m_source.depth() + 1);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            uint32_t index = stack[--size];
+            const linear_bvh_node& node = nodes[index];
+            if (!blocked_bvh_detail::intersect_node(node, slab, r.tmin, tmax, t_near)) {
+                continue;
+            }
+
+            if (node.is_leaf()) {
+                uint32_t first = m_first_block[index];
+                uint32_t last = first + (node.count + Block::width - 1) / Block::width;
+                for (uint32_t b = first; b < last; b++) {
+                    float t, u, v;
+                    if (blocked_bvh_detail::intersect_block(blocks[b], block_ray, tmax, t, u, v) >= 0) {
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            stack[size++] = node.offset;
+            stack[size++] = index + 1;
+        }
+
+        return false;
+    }
+
+    // Single ray traversal of the subtree under root
+    template <class Block>
+    bool intersect(const ray& r, hit_record& hit, uint32_t root, const block_array<Block>& blocks) const {
+        const bvh_node_array& nodes = m_source.get();
+        blocked_bvh_detail::slab_ray slab(r);
+        typename Block::ray_type block_ray(r);
+        float tmax = std::min(r.tmax, hit.t);
+        float t_near;
+
+        if (!blocked_bvh_detail::intersect_node(nodes[root], slab, r.tmin, tmax, t_near)) {
+            return false;
+        }
+
+        traversal_entry local_stack[bvh::traversal_stack_size];
+        std::vector<traversal_entry> heap_stack;
+        traversal_entry* stack = local_stack;
+        if (m_source.depth() >= bvh::traversal_stack_size) {
+            heap_stack.resize(m_source.depth() + 1);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = traversal_entry{root, t_near};
+        bool found = false;
+
+        while (size > 0) {
+            traversal_entry entry = stack[--size];
+            if (blocked_bvh_detail::beyond(entry.t_near, tmax)) {
+                continue;
+            }
+            const linear_bvh_node& node = nodes[entry.node];
+
+            if (node.is_leaf()) {
+                found |= intersect_leaf(entry.node, block_ray, tmax, hit, blocks);
+                continue;
+            }
+
+            traversal_entry first{entry.node + 1, 0.0f};
+            traversal_entry second{node.offset, 0.0f};
+            bool hit_first = blocked_bvh_detail::intersect_node(nodes[first.node], slab, r.tmin, tmax, first.t_near);
+            bool hit_second = blocked_bvh_detail::intersect_node(nodes[second.node], slab, r.tmin, tmax, second.t_near);
+            if (hit_first && hit_second) {
+                if (second.t_near < first.t_near) {
+                    std::swap(first, second);
+                }
+                stack[size++] = second;
+                stack[size++] = first;
+            } else if (hit_first) {
+                stack[size++] = first;
+            } else if (hit_second) {
+                stack[size++] = second;
+            }
+        }
+
+        return found;
+    }
+
+    template <class Block, int Size>
+    void intersect(ray_packet<Size>& packet, const block_array<Block>& blocks) const {
+        ray_packet_bounds bounds;
+        if (!bounds.compute(packet)) {
+            for (int i = 0; i < packet.size; i++) {
+                intersect(packet.get(i), packet.hits[i], 0, blocks);
+            }
+            return;
+        }
+
+        const bvh_node_array& nodes = m_source.get();
+        float packet_tmax = *std::max_element(packet.tmax, packet.tmax + packet.size);
+
+        // Both children are pushed for every interior node, like the single ray stack
+        packet_entry local_stack[bvh::traversal_stack_size];
+        std::vector<packet_entry> heap_stack;
+        packet_entry* stack = local_stack;
+        if (m_source.depth() >= bvh::traversal_stack_size) {
+            heap_stack.resize(m_source.depth() + 1);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = packet_entry{0, 0};
+
+        while (size > 0) {
+            packet_entry entry = stack[--size];
+            const linear_bvh_node& node = nodes[entry.node];
+            aabb box = node.box();
+            if (!bounds.may_hit(box, packet_tmax)) {
+                continue;
+            }
+
+            int first = entry.first;
+            float t_near;
+            while (first < packet.size && !packet.intersect_box(first, box, t_near)) {
+                first++;
+            }
+            if (first == packet.size) {
+                continue;
+            }
+
+            if (packet.size - first < min_packet_rays) {
+                for (int i = first; i < packet.size; i++) {
+                    intersect(packet.get(i), packet.hits[i], entry.node, blocks);
+                }
+            } else if (node.is_leaf()) {
+                for (int i = first; i < packet.size; i++) {
+                    float tmax = std::min(packet.tmax[i], packet.hits[i].t);
+                    intersect_leaf(entry.node, typename Block::ray_type(packet.get(i)), tmax, packet.hits[i], blocks);
+                }
+            } else {
+                // Near child by the first active ray, along the axis the child centroids differ most
+                uint32_t near_child = entry.node + 1;
+                uint32_t far_child = node.offset;
+                vector3 offset = nodes[far_child].box().centroid() - nodes[near_child].box().centroid();
+                int axis = 0;
+                for (int a = 1; a < 3; a++) {
+                    if (std::fabs(offset.data[a]) > std::fabs(offset.data[axis])) {
+                        axis = a;
+                    }
+                }
+                if ((offset.data[axis] < 0.0f) != (packet.direction[axis][first] < 0.0f)) {
+                    std::swap(near_child, far_child);
+                }
+                stack[size++] = packet_entry{far_child, first};
+                stack[size++] = packet_entry{near_child, first};
+                continue;
+            }
+
+            packet_tmax = 0.0f;
+            for (int i = 0; i < packet.size; i++) {
+                packet_tmax = std::max(packet_tmax, std::min(packet.tmax[i], packet.hits[i].t));
+            }
+        }
+    }
+};
+
+#endif //BVH_BLOCKED_BVH_H
@@ -6,141 +6,1587 @@
 #define BVH_BVH_H
 
 #include <iostream>
-#include <stack>
 #include <vector>
 #include <limits>
 #include <algorithm>
 #include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#include <string>
 
 #include "aabb.h"
+#include "arena.h"
+#include "mapped_file.h"
+#include "morton.h"
+#include "radix_sort.h"
+#include "ray.h"
+#include "simd_vector3.h"
+#include "thread_pool.h"
 #include "triangle.h"
 
+// Build-time reference to a scene triangle. The box is kept in SSE registers for the builder reductions,
+// the centroid is derived from it when needed.
 class bvh_primitive {
-    triangle tri;
-    aabb box;
-    vector3 centroid;
+    simd_aabb box;
+    uint32_t index;
 
 public:
-    explicit bvh_primitive(const triangle& tri): tri(tri) {
-        box = aabb::from_triangle(tri);
-        centroid = box.min_corner * 0.5f + box.max_corner * 0.5f;
+    bvh_primitive(const aabb& box, uint32_t index): box(box), index(index) {}
+    bvh_primitive(const simd_aabb& box, uint32_t index): box(box), index(index) {}
+
+    aabb bounding_box() const {
+        return box.to_aabb();
     }
 
-    const aabb& bounding_box() const {
+    const simd_aabb& simd_bounding_box() const {
         return box;
     }
 
     vector3 get_centroid() const {
-        return centroid;
+        return box.centroid().to_vector3();
+    }
+
+    simd_vector3 simd_centroid() const {
+        return box.centroid();
     }
 
-    const triangle& get_triangle() const {
-        return tri;
+    uint32_t triangle_index() const {
+        return index;
     }
 };
 
+// Build-time node, lives in the builder arena until the tree is flattened.
+// Every node covers a contiguous primitive range, leaves have no children.
 struct bvh_node {
     aabb box;
     bvh_node* left;
     bvh_node* right;
-    bvh_primitive* primitive;
+    uint32_t first_primitive;
+    uint32_t primitive_count;
+};
+
+// Final node layout, stored depth-first so the first child of an interior node is the next node.
+// Two vec4s in std430, so the array can be uploaded to an SSBO as is.
+struct alignas(32) linear_bvh_node {
+    vector3 min_corner;
+    uint32_t offset;    // interior: index of the second child, leaf: first entry in bvh::indices()
+    vector3 max_corner;
+    uint32_t count;     // number of primitives, 0 for interior nodes
+
+    bool is_leaf() const {
+        return count > 0;
+    }
+
+    aabb box() const {
+        return aabb{min_corner, max_corner};
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+using bvh_node_array = std::vector<linear_bvh_node, aligned_allocator<linear_bvh_node, 32>>;
+
+// Header of the binary cache written by bvh::save_cache(). It is followed by node_count
+// linear_bvh_nodes and index_count uint32_t leaf indices, both stored as in memory.
+struct alignas(32) bvh_cache_header {
+    static const uint32_t current_version = 3;
+
+    char magic[4];              // "BVHC"
+    uint32_t version;
+    uint64_t mesh_hash;         // bvh::mesh_hash() of the mesh the tree was built for
+    uint64_t options_hash;      // bvh_build_options the tree was built with
+    uint32_t node_count;
+    uint32_t index_count;
+    uint32_t depth;             // informational, load_cache() recomputes it from the nodes
+    float sah_cost;             // SAH cost right after the build, for sah_degradation()
+    uint32_t builder;           // bvh_builder that made the tree
+    uint32_t base_builder;      // optimized trees: the bvh_builder that made the tree optimize() started from
+    uint64_t optimize_hash;     // optimized trees: bvh_optimize_options of every optimize() pass, in order
+    uint32_t reserved[2];
+};
+
+static_assert(sizeof(bvh_cache_header) % alignof(linear_bvh_node) == 0, "cached nodes must stay aligned");
+
+// Which builder made a tree. The cache stores it, so build_cached() never takes another builder's tree;
+// for an optimized tree it also stores the builder it started from and the optimize options.
+enum class bvh_builder : uint32_t {
+    build = 0,      // bvh::build() with the median or SAH split
+    sbvh = 1,       // bvh::build() with bvh_split_method::sbvh
+    lbvh = 2,       // bvh::build_lbvh()
+    optimized = 3   // any of them followed by bvh::optimize()
+};
+
+enum class bvh_split_method {
+    median,
+    sah,
+    sbvh    // binned SAH plus spatial splits that clip triangle references (Stich et al. 2009)
+};
+
+struct bvh_build_options {
+    bvh_split_method split_method = bvh_split_method::median;
+
+    // Leaves hold up to this many primitives. The SAH build only makes a leaf when it is cheaper than
+    // the best split, the median and LBVH builds stop splitting at this size.
+    size_t max_leaf_size = 4;
+
+    // Binned SAH parameters
+    size_t bin_count = 16;
+    float traversal_cost = 1.0f;
+    float intersection_cost = 1.0f;
+
+    // Parallel build: nodes with at least this many primitives fork their children into tasks
+    size_t parallel_threshold = 4096;
+
+    // SBVH build: spatial splits are only tried when the children of the best object split overlap by
+    // more than this fraction of the root area, and the number of references is capped at
+    // (1 + max_duplication) * triangles
+    float spatial_split_alpha = 1e-5f;
+    float max_duplication = 0.3f;
+
+    // LBVH build: Morton code length, 30 (10 bits per axis) or 63 (21 bits per axis)
+    unsigned morton_bits = 30;
+};
+
+// Treelet restructuring (Karras and Aila 2013) applied to an already built tree
+struct bvh_optimize_options {
+    size_t treelet_leaves = 7;      // 3 to 8, every treelet is rebuilt optimally over this many subtrees
+    size_t max_passes = 3;
+    double time_budget_ms = 0.0;    // no further pass is started once it would exceed this, 0 = no limit
 };
 
+// FNV-1a, used to tell whether a cached tree belongs to the current mesh
+inline uint64_t bvh_hash_bytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 class bvh {
+    std::vector<vector3> m_vertices;
+    std::vector<triangle> m_triangles;
     std::vector<bvh_primitive> m_primitives;
-    bvh_node* root;
+    bvh_build_options m_options;
+    bvh_node_array m_nodes;
+    std::vector<uint32_t> m_indices;
+    std::vector<triangle> m_leaf_triangles;
+    float m_built_sah_cost = 0.0f;
+    size_t m_depth = 0;
+    bvh_builder m_builder = bvh_builder::build;
+    bvh_builder m_base_builder = bvh_builder::build;
+    uint64_t m_optimize_hash = 0;
+    float m_duplication = 1.0f;
+    arena m_arena;
+
+    // Build state
+    thread_pool* m_pool = nullptr;
+    bvh_node* m_build_nodes = nullptr;
+    std::atomic<uint32_t> m_next_node{0};
+    size_t m_reference_count = 0;
+    size_t m_reference_limit = 0;
+    float m_root_area = 0.0f;
+
+    static const size_t reduction_grain = 16384;
+
+    struct traversal_entry {
+        uint32_t node;
+        float t_near;
+    };
+
+    // Unflattened tree the treelet optimizer works on, with one primitive per leaf. Every array is
+    // indexed by node; collapsed marks subtrees that are cheaper as a single leaf.
+    struct treelet_tree {
+        bvh_node* nodes;
+        uint32_t* parents;
+        uint32_t* leaf_counts;
+        float* costs;
+        bool* collapsed;
+
+        uint32_t index(const bvh_node* node) const {
+            return static_cast<uint32_t>(node - nodes);
+        }
+    };
+
+    static const size_t treelet_grain = 256;
 
 public:
-    explicit bvh(const std::vector<triangle>& triangles) {
-        for (const auto& tri : triangles) {
-            m_primitives.emplace_back(tri);
+    static const size_t traversal_stack_size = 128;
+
+    bvh(const std::vector<triangle>& triangles, const std::vector<vec3>& vertices): m_triangles(triangles) {
+        for (const auto& v : vertices) {
+            m_vertices.emplace_back(v.x, v.y, v.z);
+        }
+        for (size_t i = 0; i < triangles.size(); i++) {
+            m_primitives.emplace_back(simd_aabb::from_triangle(triangles[i], m_vertices), static_cast<uint32_t>(i));
         }
     }
 
-    void build() {
-        root = build_recursive(m_primitives, 0, m_primitives.size());
+    bvh(bvh&& other) noexcept: m_vertices(std::move(other.m_vertices)), m_triangles(std::move(other.m_triangles)),
+                               m_primitives(std::move(other.m_primitives)), m_options(other.m_options),
+                               m_nodes(std::move(other.m_nodes)), m_indices(std::move(other.m_indices)),
+                               m_leaf_triangles(std::move(other.m_leaf_triangles)),
+                               m_built_sah_cost(other.m_built_sah_cost), m_depth(other.m_depth),
+                               m_builder(other.m_builder), m_base_builder(other.m_base_builder),
+                               m_optimize_hash(other.m_optimize_hash), m_duplication(other.m_duplication),
+                               m_arena(std::move(other.m_arena)) {}
+
+    void build(const bvh_build_options& options = bvh_build_options()) {
+        build(options, nullptr);
     }
 
-    const bvh_node* get() const {
-        if(root == nullptr)
+    // Same tree as the serial build: only independent subtrees and order-insensitive reductions run in parallel
+    void build(const bvh_build_options& options, thread_pool& pool) {
+        build(options, &pool);
+    }
+
+    // Linear BVH (Karras 2012): primitives are sorted along a Morton curve and every internal node
+    // finds its own range and split independently. Much faster than build() but gives a worse tree,
+    // meant for per-frame rebuilds of deforming geometry.
+    void build_lbvh(const bvh_build_options& options = bvh_build_options()) {
+        build_lbvh(options, nullptr);
+    }
+
+    void build_lbvh(const bvh_build_options& options, thread_pool& pool) {
+        build_lbvh(options, &pool);
+    }
+
+    // Recomputes all node bounds bottom-up for moved vertices, keeping the topology.
+    // Returns sah_degradation(): once it grows well above 1 a full build() pays off again.
+    float refit(const std::vector<vec3>& vertices) {
+        return refit(vertices, nullptr);
+    }
+
+    // Independent subtrees are refitted in parallel, the few nodes above them afterwards
+    float refit(const std::vector<vec3>& vertices, thread_pool& pool) {
+        return refit(vertices, &pool);
+    }
+
+    // Improves a built tree in place by rebuilding small treelets for minimal SAH cost, bottom-up.
+    // Leaves are split into single primitives first and collapsed again by SAH cost, up to the
+    // max_leaf_size of the last build, so a fast build() with the median split or build_lbvh()
+    // followed by optimize() gets close to a SAH build. Returns the new SAH cost.
+    float optimize(const bvh_optimize_options& options = bvh_optimize_options()) {
+        return optimize(options, nullptr);
+    }
+
+    // Treelets of independent subtrees are processed in parallel, the result does not depend on the thread count
+    float optimize(const bvh_optimize_options& options, thread_pool& pool) {
+        return optimize(options, &pool);
+    }
+
+    // SAH cost of the current tree relative to the cost right after the last build
+    float sah_degradation() const {
+        return m_built_sah_cost > 0.0f ? sah_cost() / m_built_sah_cost : 1.0f;
+    }
+
+    // Frees the build scratch memory kept around for the next build()
+    void release_scratch() {
+        m_arena.release();
+    }
+
+    const bvh_node_array& get() const {
+        if (m_nodes.empty())
             throw std::runtime_error("BVH not built");
-        return root;
+        return m_nodes;
     }
 
-    void print() {
-        std::stack<bvh_node*> stack;
-        stack.push(root);
+    // Original triangle index of every leaf entry, a leaf covers [offset, offset + count)
+    const std::vector<uint32_t>& indices() const {
+        return m_indices;
+    }
 
-        while (!stack.empty()) {
-            bvh_node* node = stack.top();
-            stack.pop();
+    // Triangles reordered to match indices(), so the triangles of a leaf are contiguous
+    const std::vector<triangle>& triangles() const {
+        return m_leaf_triangles;
+    }
+
+    const std::vector<vector3>& vertices() const {
+        return m_vertices;
+    }
 
-            std::cout << "Box: (" << node->box.min_corner.data[0] << ", " << node->box.min_corner.data[1] << ", " << node->box.min_corner.data[2] << ") - ("
-                      << node->box.max_corner.data[0] << ", " << node->box.max_corner.data[1] << ", " << node->box.max_corner.data[2] << ")" << std::endl;
+    // Leaf references per triangle, above 1 only for SBVH builds where spatial splits duplicate triangles
+    float duplication_ratio() const {
+        return m_duplication;
+    }
+
+    // Number of nodes on the longest root-to-leaf path
+    size_t depth() const {
+        return m_depth;
+    }
+
+    bvh_builder builder() const {
+        return m_builder;
+    }
 
-            if (node->left) {
-                stack.push(node->left);
+    // Builder of the tree before optimize(), builder() for a tree that was not optimized
+    bvh_builder base_builder() const {
+        return m_base_builder;
+    }
+
+    // Builder of build(options)
+    static bvh_builder builder_for(const bvh_build_options& options) {
+        return options.split_method == bvh_split_method::sbvh ? bvh_builder::sbvh : bvh_builder::build;
+    }
+
+    // Hash of the vertex positions and triangle indices the tree is built over
+    uint64_t mesh_hash() const {
+        uint64_t hash = bvh_hash_bytes(m_vertices.data(), m_vertices.size() * sizeof(vector3));
+        return bvh_hash_bytes(m_triangles.data(), m_triangles.size() * sizeof(triangle), hash);
+    }
+
+    // Loads the tree from a cache file if one exists for this mesh and these options, otherwise
+    // builds it and writes the cache. Returns true when the cache was used.
+    bool build_cached(const std::string& filename, const bvh_build_options& options = bvh_build_options()) {
+        if (load_cache(filename, options)) {
+            return true;
+        }
+        build(options);
+        save_cache(filename);
+        return false;
+    }
+
+    void save_cache(const std::string& filename) const {
+        const bvh_node_array& nodes = get();
+        bvh_cache_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "BVHC", 4);
+        header.version = bvh_cache_header::current_version;
+        header.mesh_hash = mesh_hash();
+        header.options_hash = options_hash(m_options);
+        header.node_count = static_cast<uint32_t>(nodes.size());
+        header.index_count = static_cast<uint32_t>(m_indices.size());
+        header.depth = static_cast<uint32_t>(m_depth);
+        header.sah_cost = m_built_sah_cost;
+        header.builder = static_cast<uint32_t>(m_builder);
+        header.base_builder = static_cast<uint32_t>(m_base_builder);
+        header.optimize_hash = m_optimize_hash;
+
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file");
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(linear_bvh_node));
+        file.write(reinterpret_cast<const char*>(m_indices.data()), m_indices.size() * sizeof(uint32_t));
+        if (!file) {
+            throw std::runtime_error("Failed to write BVH cache");
+        }
+    }
+
+    // Maps the cache file and copies the node and index arrays out as they are. Returns false, leaving
+    // the tree untouched, when the file is missing, truncated, damaged, from another version, or was
+    // built for a different mesh, different options or by another builder than build(options).
+    bool load_cache(const std::string& filename, const bvh_build_options& options = bvh_build_options()) {
+        return load_cache(filename, options, builder_for(options));
+    }
+
+    // Same for a tree made by the given builder, e.g. bvh_builder::lbvh after build_lbvh(options).
+    // An optimized tree is asked for with the overload below.
+    bool load_cache(const std::string& filename, const bvh_build_options& options, bvh_builder builder) {
+        if (builder == bvh_builder::optimized) {
+            throw std::invalid_argument("An optimized tree needs its base builder and optimize options");
+        }
+        return load_cache(filename, options, builder, builder, 0);
+    }
+
+    // Same for a tree made by base_builder and then one optimize(optimize_options) pass
+    bool load_cache(const std::string& filename, const bvh_build_options& options, bvh_builder base_builder,
+                    const bvh_optimize_options& optimize_options) {
+        if (base_builder == bvh_builder::optimized) {
+            throw std::invalid_argument("The base builder of an optimized tree cannot be optimized");
+        }
+        return load_cache(filename, options, bvh_builder::optimized, base_builder, optimize_options_hash(optimize_options));
+    }
+
+    // Closest hit in (r.tmin, r.tmax), near child first
+    bool intersect(const ray& r, hit_record& hit) const {
+        const bvh_node_array& nodes = get();
+        vector3 inv_direction = r.inv_direction();
+        float tmax = std::min(r.tmax, hit.t);
+        float t_near;
+
+        if (!nodes[0].box().intersect(r.origin, inv_direction, r.tmin, tmax, t_near)) {
+            return false;
+        }
+
+        // Entries are nodes whose box was already hit, together with the entry distance
+        traversal_entry local_stack[traversal_stack_size];
+        std::vector<traversal_entry> heap_stack;
+        traversal_entry* stack = local_stack;
+        if (m_depth >= traversal_stack_size) {
+            heap_stack.resize(m_depth + 1);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = traversal_entry{0, t_near};
+        bool found = false;
+
+        while (size > 0) {
+            traversal_entry entry = stack[--size];
+            if (entry.t_near > tmax) {
+                continue;
+            }
+            const linear_bvh_node& node = nodes[entry.node];
+
+            if (node.is_leaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    const triangle& tri = m_leaf_triangles[i];
+                    float t, u, v;
+                    if (intersect_triangle(r, m_vertices[tri.vertices_ids[0]], m_vertices[tri.vertices_ids[1]],
+                                           m_vertices[tri.vertices_ids[2]], tmax, t, u, v)) {
+                        tmax = t;
+                        hit.t = t;
+                        hit.u = u;
+                        hit.v = v;
+                        hit.triangle = m_indices[i];
+                        found = true;
+                    }
+                }
+                continue;
             }
 
-            if (node->right) {
-                stack.push(node->right);
+            traversal_entry first{entry.node + 1, 0.0f};
+            traversal_entry second{node.offset, 0.0f};
+            bool hit_first = nodes[first.node].box().intersect(r.origin, inv_direction, r.tmin, tmax, first.t_near);
+            bool hit_second = nodes[second.node].box().intersect(r.origin, inv_direction, r.tmin, tmax, second.t_near);
+            if (hit_first && hit_second) {
+                if (second.t_near < first.t_near) {
+                    std::swap(first, second);
+                }
+                stack[size++] = second;
+                stack[size++] = first;
+            } else if (hit_first) {
+                stack[size++] = first;
+            } else if (hit_second) {
+                stack[size++] = second;
             }
         }
+
+        return found;
+    }
+
+    // True if anything lies in (r.tmin, min(r.tmax, tmax)). Stops at the first hit found and
+    // skips the distance sort of intersect(): children are visited in stored order.
+    bool occluded(const ray& r, float tmax) const {
+        const bvh_node_array& nodes = get();
+        vector3 inv_direction = r.inv_direction();
+        tmax = std::min(r.tmax, tmax);
+        float t_near;
+
+        uint32_t local_stack[traversal_stack_size];
+        std::vector<uint32_t> heap_stack;
+        uint32_t* stack = local_stack;
+        if (m_depth >= traversal_stack_size) {
+            heap_stack.resize(m_depth + 1);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            uint32_t index = stack[--size];
+            const linear_bvh_node& node = nodes[index];
+            if (!node.box().intersect(r.origin, inv_direction, r.tmin, tmax, t_near)) {
+                continue;
+            }
+
+            if (node.is_leaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    const triangle& tri = m_leaf_triangles[i];
+                    float t, u, v;
+                    if (intersect_triangle(r, m_vertices[tri.vertices_ids[0]], m_vertices[tri.vertices_ids[1]],
+                                           m_vertices[tri.vertices_ids[2]], tmax, t, u, v)) {
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            stack[size++] = node.offset;
+            stack[size++] = index + 1;
+        }
+
+        return false;
+    }
+
+    // Expected cost of tracing a random ray through the tree, normalized by the root area
+    float sah_cost() const {
+        const bvh_node_array& nodes = get();
+        float root_area = nodes[0].box().surface_area();
+        if (root_area <= 0.0f) {
+            return 0.0f;
+        }
+
+        float cost = 0.0f;
+        for (const auto& node : nodes) {
+            float area = node.box().surface_area() / root_area;
+            if (node.is_leaf()) {
+                cost += m_options.intersection_cost * node.count * area;
+            } else {
+                cost += m_options.traversal_cost * area;
+            }
+        }
+
+        return cost;
+    }
+
+    void print() {
+        for (const auto& node : get()) {
+            std::cout << "Box: (" << node.min_corner.data[0] << ", " << node.min_corner.data[1] << ", " << node.min_corner.data[2] << ") - ("
+                      << node.max_corner.data[0] << ", " << node.max_corner.data[1] << ", " << node.max_corner.data[2] << ")" << std::endl;
+        }
     }
 
 private:
+    static uint64_t options_hash(const bvh_build_options& options) {
+        uint32_t method = static_cast<uint32_t>(options.split_method);
+        uint64_t hash = bvh_hash_bytes(&method, sizeof(method));
+        hash = bvh_hash_bytes(&options.max_leaf_size, sizeof(options.max_leaf_size), hash);
+        hash = bvh_hash_bytes(&options.bin_count, sizeof(options.bin_count), hash);
+        hash = bvh_hash_bytes(&options.traversal_cost, sizeof(options.traversal_cost), hash);
+        hash = bvh_hash_bytes(&options.intersection_cost, sizeof(options.intersection_cost), hash);
+        hash = bvh_hash_bytes(&options.spatial_split_alpha, sizeof(options.spatial_split_alpha), hash);
+        hash = bvh_hash_bytes(&options.max_duplication, sizeof(options.max_duplication), hash);
+        return bvh_hash_bytes(&options.morton_bits, sizeof(options.morton_bits), hash);
+    }
+
+    // Loads the cache if its header matches all of these, see the public overloads
+    bool load_cache(const std::string& filename, const bvh_build_options& options, bvh_builder builder,
+                    bvh_builder base_builder, uint64_t optimize_hash) {
+        mapped_file file(filename);
+        if (!file.is_open() || file.size() < sizeof(bvh_cache_header)) {
+            return false;
+        }
+
+        bvh_cache_header header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, "BVHC", 4) != 0 || header.version != bvh_cache_header::current_version ||
+            header.mesh_hash != mesh_hash() || header.options_hash != options_hash(options) || header.node_count == 0 ||
+            header.builder != static_cast<uint32_t>(builder) ||
+            header.base_builder != static_cast<uint32_t>(base_builder) || header.optimize_hash != optimize_hash) {
+            return false;
+        }
+
+        size_t node_bytes = static_cast<size_t>(header.node_count) * sizeof(linear_bvh_node);
+        size_t index_bytes = static_cast<size_t>(header.index_count) * sizeof(uint32_t);
+        if (file.size() != sizeof(header) + node_bytes + index_bytes) {
+            return false;
+        }
+
+        const unsigned char* data = file.data() + sizeof(header);
+        const linear_bvh_node* nodes = reinterpret_cast<const linear_bvh_node*>(data);
+        const uint32_t* indices = reinterpret_cast<const uint32_t*>(data + node_bytes);
+        for (uint32_t i = 0; i < header.index_count; i++) {
+            if (indices[i] >= m_triangles.size()) {
+                return false;
+            }
+        }
+
+        // Traversal must stay inside the arrays: in the depth-first layout both children come after
+        // their parent and leaves cover a range of the indices. The depth that sizes the traversal
+        // stack is taken from the nodes, not from the header.
+        std::vector<uint32_t> node_depth(header.node_count, 0);
+        node_depth[0] = 1;
+        size_t depth = 0;
+        for (uint32_t i = 0; i < header.node_count; i++) {
+            if (node_depth[i] == 0) {
+                continue;
+            }
+            depth = std::max(depth, static_cast<size_t>(node_depth[i]));
+            const linear_bvh_node& node = nodes[i];
+            if (node.is_leaf()) {
+                if (node.offset > header.index_count || node.count > header.index_count - node.offset) {
+                    return false;
+                }
+                continue;
+            }
+            if (i + 1 >= header.node_count || node.offset <= i + 1 || node.offset >= header.node_count) {
+                return false;
+            }
+            node_depth[i + 1] = std::max(node_depth[i + 1], node_depth[i] + 1);
+            node_depth[node.offset] = std::max(node_depth[node.offset], node_depth[i] + 1);
+        }
+
+        m_options = options;
+        m_nodes.assign(nodes, nodes + header.node_count);
+        m_indices.assign(indices, indices + header.index_count);
+        m_leaf_triangles.clear();
+        m_leaf_triangles.reserve(m_indices.size());
+        for (uint32_t index : m_indices) {
+            m_leaf_triangles.push_back(m_triangles[index]);
+        }
+        m_depth = depth;
+        m_builder = builder;
+        m_base_builder = base_builder;
+        m_optimize_hash = optimize_hash;
+        m_built_sah_cost = header.sah_cost;
+        m_duplication = static_cast<float>(m_indices.size()) / static_cast<float>(m_triangles.size());
+        return true;
+    }
+
+    // Every optimize() pass is hashed on top of the previous ones, seed is the hash so far
+    static uint64_t optimize_options_hash(const bvh_optimize_options& options, uint64_t seed = 14695981039346656037ull) {
+        uint64_t hash = bvh_hash_bytes(&options.treelet_leaves, sizeof(options.treelet_leaves), seed);
+        hash = bvh_hash_bytes(&options.max_passes, sizeof(options.max_passes), hash);
+        return bvh_hash_bytes(&options.time_budget_ms, sizeof(options.time_budget_ms), hash);
+    }
+
+    void set_builder(bvh_builder builder) {
+        m_builder = builder;
+        m_base_builder = builder;
+        m_optimize_hash = 0;
+    }
+
+    void mark_optimized(const bvh_optimize_options& options) {
+        if (m_builder == bvh_builder::optimized) {
+            m_optimize_hash = optimize_options_hash(options, m_optimize_hash);
+        } else {
+            m_base_builder = m_builder;
+            m_optimize_hash = optimize_options_hash(options);
+        }
+        m_builder = bvh_builder::optimized;
+    }
+
+    void build(const bvh_build_options& options, thread_pool* pool) {
+        if (options.split_method != bvh_split_method::median && options.bin_count < 2) {
+            throw std::invalid_argument("SAH build needs at least 2 bins");
+        }
+        m_options = options;
+        set_builder(builder_for(options));
+        m_nodes.clear();
+        if (m_primitives.empty()) {
+            return;
+        }
+
+        if (options.split_method == bvh_split_method::sbvh) {
+            build_sbvh();
+            return;
+        }
+
+        // A binary tree over n leaves has at most 2n - 1 nodes, so every task can grab slots lock-free
+        m_pool = pool;
+        m_build_nodes = m_arena.allocate<bvh_node>(2 * m_primitives.size() - 1);
+        m_next_node = 0;
+
+        bvh_node* root = build_recursive(m_primitives, 0, m_primitives.size());
+        finish_build(root, m_primitives, m_next_node.load(), 0);
+    }
+
+    // Serial: the reference budget is shared by the whole tree
+    void build_sbvh() {
+        size_t n = m_primitives.size();
+        m_reference_count = n;
+        m_reference_limit = std::max(n, static_cast<size_t>(static_cast<double>(n) * (1.0 + std::max(m_options.max_duplication, 0.0f))));
+        m_build_nodes = m_arena.allocate<bvh_node>(2 * m_reference_limit - 1);
+        m_next_node = 0;
+
+        std::vector<bvh_primitive> references(m_primitives);
+        std::vector<bvh_primitive> leaf_references;
+        leaf_references.reserve(m_reference_limit);
+        m_root_area = bounds(references, 0, references.size()).surface_area();
+
+        bvh_node* root = build_sbvh_recursive(references, leaf_references);
+        finish_build(root, leaf_references, m_next_node.load(), 0);
+    }
+
+    bvh_node* build_sbvh_recursive(std::vector<bvh_primitive>& references, std::vector<bvh_primitive>& leaf_references) {
+        bvh_node* node = &m_build_nodes[m_next_node++];
+        node->box = bounds(references, 0, references.size());
+        node->first_primitive = static_cast<uint32_t>(leaf_references.size());
+
+        size_t count = references.size();
+        float object_cost = std::numeric_limits<float>::infinity();
+        size_t mid = count == 1 ? count : split_sah(references, 0, count, node->box, object_cost);
+
+        // Spatial splits only pay off where the object split leaves a lot of overlap
+        float spatial_cost = std::numeric_limits<float>::infinity();
+        int spatial_axis = -1;
+        float spatial_position = 0.0f;
+        if (mid != count && m_reference_count < m_reference_limit && m_root_area > 0.0f) {
+            aabb overlap = aabb::intersection(bounds(references, 0, mid), bounds(references, mid, count));
+            if (overlap.surface_area() / m_root_area > m_options.spatial_split_alpha) {
+                find_spatial_split(references, node->box, spatial_cost, spatial_axis, spatial_position);
+            }
+        }
+
+        float split_cost = std::min(object_cost, spatial_cost);
+        if (count == 1 || (count <= m_options.max_leaf_size && m_options.intersection_cost * count <= split_cost)) {
+            node->left = nullptr;
+            node->right = nullptr;
+            leaf_references.insert(leaf_references.end(), references.begin(), references.end());
+            node->primitive_count = static_cast<uint32_t>(count);
+            return node;
+        }
+
+        std::vector<bvh_primitive> left;
+        std::vector<bvh_primitive> right;
+        if (spatial_cost < object_cost) {
+            split_spatial(references, spatial_axis, spatial_position, left, right);
+        }
+        if (left.empty() || right.empty()) {
+            if (mid == count) {
+                mid = split_median(references, 0, count, node->box);
+            }
+            left.assign(references.begin(), references.begin() + mid);
+            right.assign(references.begin() + mid, references.end());
+        }
+        std::vector<bvh_primitive>().swap(references);
+
+        node->left = build_sbvh_recursive(left, leaf_references);
+        node->right = build_sbvh_recursive(right, leaf_references);
+        node->primitive_count = static_cast<uint32_t>(leaf_references.size() - node->first_primitive);
+        return node;
+    }
+
+    // Clips the part of the triangle inside reference's box at an axis-aligned plane
+    void split_reference(const bvh_primitive& reference, int axis, float position, aabb& left, aabb& right) const {
+        left = aabb::empty();
+        right = aabb::empty();
+        const triangle& tri = m_triangles[reference.triangle_index()];
+        for (int i = 0; i < 3; i++) {
+            const vector3& v0 = m_vertices[tri.vertices_ids[i]];
+            const vector3& v1 = m_vertices[tri.vertices_ids[(i + 1) % 3]];
+            float p0 = v0.data[axis];
+            float p1 = v1.data[axis];
+            if (p0 <= position) {
+                left.expand(v0);
+            }
+            if (p0 >= position) {
+                right.expand(v0);
+            }
+            if ((p0 < position && position < p1) || (p1 < position && position < p0)) {
+                vector3 point = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+                point.data[axis] = position;
+                left.expand(point);
+                right.expand(point);
+            }
+        }
+
+        left.max_corner.data[axis] = std::min(left.max_corner.data[axis], position);
+        right.min_corner.data[axis] = std::max(right.min_corner.data[axis], position);
+        aabb box = reference.bounding_box();
+        left = aabb::intersection(left, box);
+        right = aabb::intersection(right, box);
+    }
+
+    // Binned spatial split search: references are chopped into every bin they overlap
+    void find_spatial_split(const std::vector<bvh_primitive>& references, const aabb& box,
+                            float& best_cost, int& best_axis, float& best_position) const {
+        size_t bin_count = m_options.bin_count;
+        std::vector<sah_bin> bins(bin_count);
+        std::vector<size_t> exits(bin_count);
+        std::vector<float> right_area(bin_count);
+        std::vector<size_t> right_count(bin_count);
+        float parent_area = box.surface_area();
+
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = box.min_corner.data[axis];
+            float width = (box.max_corner.data[axis] - lo) / static_cast<float>(bin_count);
+            if (width <= 0.0f) {
+                continue;
+            }
+
+            std::fill(bins.begin(), bins.end(), sah_bin());
+            std::fill(exits.begin(), exits.end(), 0);
+            for (const auto& reference : references) {
+                size_t first = bin_index(reference.bounding_box().min_corner.data[axis], lo, 1.0f / width, bin_count);
+                size_t last = bin_index(reference.bounding_box().max_corner.data[axis], lo, 1.0f / width, bin_count);
+                last = std::max(first, last);
+
+                bvh_primitive current = reference;
+                for (size_t b = first; b < last; b++) {
+                    aabb left, right;
+                    split_reference(current, axis, lo + width * static_cast<float>(b + 1), left, right);
+                    bins[b].box.merge(simd_aabb(left));
+                    current = bvh_primitive(right, reference.triangle_index());
+                }
+                bins[last].box.merge(current.simd_bounding_box());
+                bins[first].count++;
+                exits[last]++;
+            }
+
+            simd_aabb right_box = simd_aabb::empty();
+            size_t count = 0;
+            for (size_t b = bin_count - 1; b > 0; b--) {
+                right_box.merge(bins[b].box);
+                count += exits[b];
+                right_area[b] = right_box.surface_area();
+                right_count[b] = count;
+            }
+
+            simd_aabb left_box = simd_aabb::empty();
+            count = 0;
+            for (size_t b = 1; b < bin_count; b++) {
+                left_box.merge(bins[b - 1].box);
+                count += bins[b - 1].count;
+                if (count == 0 || right_count[b] == 0) {
+                    continue;
+                }
+
+                float cost = m_options.traversal_cost + m_options.intersection_cost *
+                        (left_box.surface_area() * count + right_area[b] * right_count[b]) / parent_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_position = lo + width * static_cast<float>(b);
+                }
+            }
+        }
+    }
+
+    // Straddling references go to both sides while the duplication budget lasts, then by centroid
+    void split_spatial(const std::vector<bvh_primitive>& references, int axis, float position,
+                       std::vector<bvh_primitive>& left, std::vector<bvh_primitive>& right) {
+        size_t duplicated = 0;
+        for (const auto& reference : references) {
+            aabb box = reference.bounding_box();
+            if (box.max_corner.data[axis] <= position) {
+                left.push_back(reference);
+            } else if (box.min_corner.data[axis] >= position) {
+                right.push_back(reference);
+            } else if (m_reference_count + duplicated < m_reference_limit) {
+                aabb left_box, right_box;
+                split_reference(reference, axis, position, left_box, right_box);
+                if (left_box.is_empty()) {
+                    right.push_back(reference);
+                } else if (right_box.is_empty()) {
+                    left.push_back(reference);
+                } else {
+                    left.emplace_back(left_box, reference.triangle_index());
+                    right.emplace_back(right_box, reference.triangle_index());
+                    duplicated++;
+                }
+            } else if (reference.get_centroid().data[axis] < position) {
+                left.push_back(reference);
+            } else {
+                right.push_back(reference);
+            }
+        }
+
+        // Duplication cannot make progress when everything straddles, the budget is only spent on kept splits
+        if (left.size() == references.size() || right.size() == references.size()) {
+            left.clear();
+            right.clear();
+            return;
+        }
+        m_reference_count += duplicated;
+    }
+
     bvh_node* build_recursive(std::vector<bvh_primitive>& primitives, size_t start, size_t end) {
         if (start == end) {
             return nullptr;
         }
 
-        bvh_node* node = new bvh_node;
-        node->box = aabb();
-        for (size_t i = start; i < end; i++) {
-            node->box = aabb::surrounding_box(node->box, primitives[i].bounding_box());
+        bvh_node* node = &m_build_nodes[m_next_node.fetch_add(1, std::memory_order_relaxed)];
+        node->box = bounds(primitives, start, end);
+        node->first_primitive = static_cast<uint32_t>(start);
+        node->primitive_count = static_cast<uint32_t>(end - start);
+
+        size_t count = end - start;
+        size_t mid = end;
+        bool leaf = count == 1;
+        if (!leaf && m_options.split_method == bvh_split_method::sah) {
+            float split_cost = std::numeric_limits<float>::infinity();
+            mid = split_sah(primitives, start, end, node->box, split_cost);
+            leaf = count <= m_options.max_leaf_size && m_options.intersection_cost * count <= split_cost;
+        } else if (!leaf) {
+            leaf = count <= m_options.max_leaf_size;
         }
 
-        if (end - start == 1) {
+        if (leaf) {
             node->left = nullptr;
             node->right = nullptr;
-            node->primitive = &primitives[start];
         } else {
-            size_t axis = node->box.longest_axis();
-            size_t mid = (start + end) / 2;
-            std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end,
-                             [axis](const bvh_primitive& a, const bvh_primitive& b) {
-                                 return a.get_centroid().data[axis] < b.get_centroid().data[axis];
-                             });
+            if (mid == end) {
+                mid = split_median(primitives, start, end, node->box);
+            }
 
-            node->left = build_recursive(primitives, start, mid);
-            node->right = build_recursive(primitives, mid, end);
-            node->primitive = nullptr;
+            if (m_pool != nullptr && end - start >= m_options.parallel_threshold) {
+                task_group group(*m_pool);
+                group.run([this, &primitives, node, start, mid]() {
+                    node->left = build_recursive(primitives, start, mid);
+                });
+                node->right = build_recursive(primitives, mid, end);
+                group.wait();
+            } else {
+                node->left = build_recursive(primitives, start, mid);
+                node->right = build_recursive(primitives, mid, end);
+            }
         }
 
         return node;
     }
 
-public:
-    std::vector<aabb> serialize() {
-        std::vector<aabb> boxes;
-        std::stack<bvh_node*> stack;
-        stack.push(root);
+    void build_lbvh(const bvh_build_options& options, thread_pool* pool) {
+        if (options.morton_bits != 30 && options.morton_bits != 63) {
+            throw std::invalid_argument("LBVH Morton codes must be 30 or 63 bits");
+        }
+        m_options = options;
+        set_builder(bvh_builder::lbvh);
+        m_nodes.clear();
+        if (m_primitives.empty()) {
+            return;
+        }
+
+        m_pool = pool;
+        size_t n = m_primitives.size();
+
+        aabb centroid_box = centroid_bounds(m_primitives, 0, n);
+        std::vector<uint64_t> keys(n);
+        std::vector<uint32_t> order(n);
+        parallel_for(pool, 0, n, reduction_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                vector3 centroid = m_primitives[i].get_centroid();
+                keys[i] = options.morton_bits == 30 ? morton_code_30(centroid, centroid_box) : morton_code_63(centroid, centroid_box);
+                order[i] = static_cast<uint32_t>(i);
+            }
+        });
+        radix_sort_pairs(keys, order, options.morton_bits, pool);
+
+        std::vector<bvh_primitive> sorted;
+        sorted.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            sorted.push_back(m_primitives[order[i]]);
+        }
+        m_primitives.swap(sorted);
+
+        // Internal nodes are [0, n - 1) with the root at 0, leaf i is node n - 1 + i
+        m_build_nodes = m_arena.allocate<bvh_node>(2 * n - 1);
+        bvh_node* leaves = m_build_nodes + (n - 1);
+        uint32_t* parents = m_arena.allocate<uint32_t>(2 * n - 1);
+        std::atomic<uint32_t>* visits = m_arena.allocate<std::atomic<uint32_t>>(n - 1);
+
+        parallel_for(pool, 0, n, reduction_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                leaves[i].box = m_primitives[i].bounding_box();
+                leaves[i].left = nullptr;
+                leaves[i].right = nullptr;
+                leaves[i].first_primitive = static_cast<uint32_t>(i);
+                leaves[i].primitive_count = 1;
+            }
+        });
+
+        parallel_for(pool, 0, n - 1, reduction_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                int64_t first, last, split;
+                lbvh_range_and_split(keys, static_cast<int64_t>(i), first, last, split);
+
+                uint32_t left = static_cast<uint32_t>(first == split ? n - 1 + split : split);
+                uint32_t right = static_cast<uint32_t>(last == split + 1 ? n - 1 + split + 1 : split + 1);
+                m_build_nodes[i].left = &m_build_nodes[left];
+                m_build_nodes[i].right = &m_build_nodes[right];
+                m_build_nodes[i].first_primitive = static_cast<uint32_t>(first);
+                m_build_nodes[i].primitive_count = static_cast<uint32_t>(last - first + 1);
+                parents[left] = static_cast<uint32_t>(i);
+                parents[right] = static_cast<uint32_t>(i);
+                visits[i].store(0, std::memory_order_relaxed);
+            }
+        });
+
+        // Bottom-up bounds: the second child to arrive at a node merges both boxes and keeps climbing
+        if (n > 1) {
+            parallel_for(pool, 0, n, reduction_grain, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    uint32_t node = parents[n - 1 + i];
+                    while (visits[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                        bvh_node& internal = m_build_nodes[node];
+                        internal.box = aabb::surrounding_box(internal.left->box, internal.right->box);
+                        if (node == 0) {
+                            break;
+                        }
+                        node = parents[node];
+                    }
+                }
+            });
+        }
+
+        // Karras leaves hold one primitive each, small subtrees are collapsed while flattening
+        finish_build(n > 1 ? &m_build_nodes[0] : leaves, m_primitives, 2 * n - 1, m_options.max_leaf_size);
+    }
+
+    float optimize(const bvh_optimize_options& options, thread_pool* pool) {
+        if (options.treelet_leaves < 3 || options.treelet_leaves > 8) {
+            throw std::invalid_argument("Treelets need 3 to 8 leaves");
+        }
+        get();
+        mark_optimized(options);
+        if (m_indices.size() < 3) {
+            return sah_cost();
+        }
+        auto start = std::chrono::steady_clock::now();
+
+        // A binary tree over one primitive per leaf
+        size_t node_count = 2 * m_indices.size() - 1;
+        treelet_tree tree;
+        tree.nodes = m_arena.allocate<bvh_node>(node_count);
+        tree.parents = m_arena.allocate<uint32_t>(node_count);
+        tree.leaf_counts = m_arena.allocate<uint32_t>(node_count);
+        tree.costs = m_arena.allocate<float>(node_count);
+        tree.collapsed = m_arena.allocate<bool>(node_count);
+        std::atomic<uint32_t>* visits = m_arena.allocate<std::atomic<uint32_t>>(node_count);
+
+        std::vector<uint32_t> leaves;
+        leaves.reserve(m_indices.size());
+        size_t next_node = 1;
+        unflatten(tree, 0, 0, next_node, leaves);
+        double last_pass_ms = 0.0;
+        for (size_t pass = 0; pass < options.max_passes; pass++) {
+            double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (pass > 0 && options.time_budget_ms > 0.0 && elapsed_ms + last_pass_ms > options.time_budget_ms) {
+                break;
+            }
+
+            for (size_t i = 0; i < node_count; i++) {
+                visits[i].store(0, std::memory_order_relaxed);
+            }
+
+            // The second thread to arrive at a node owns its finished subtree and restructures the treelet below it
+            std::atomic<bool> changed{false};
+            parallel_for(pool, 0, leaves.size(), treelet_grain, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    uint32_t node = tree.parents[leaves[i]];
+                    while (visits[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                        if (tree.leaf_counts[node] >= 3 && optimize_treelet(tree, node, options.treelet_leaves)) {
+                            changed.store(true, std::memory_order_relaxed);
+                        }
+                        if (node == 0) {
+                            break;
+                        }
+                        node = tree.parents[node];
+                    }
+                }
+            });
+
+            last_pass_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() - elapsed_ms;
+            if (!changed.load()) {
+                break;
+            }
+        }
+
+        // Collapsed subtrees become leaves, primitives are renumbered in depth-first order
+        std::vector<bvh_primitive> leaf_references;
+        leaf_references.reserve(m_indices.size());
+        collapse_treelets(tree, &tree.nodes[0], leaf_references);
+        m_nodes.clear();
+        finish_build(&tree.nodes[0], leaf_references, node_count, 0);
+        return sah_cost();
+    }
+
+    // Copies flat node `index` to tree node `slot`, children go to fresh slots. Leaves are split
+    // into single primitives under a balanced subtree, their boxes clipped to the leaf box.
+    void unflatten(treelet_tree& tree, uint32_t index, uint32_t slot, size_t& next_node, std::vector<uint32_t>& leaves) const {
+        const linear_bvh_node& flat = m_nodes[index];
+        if (flat.is_leaf()) {
+            split_leaf(tree, slot, flat.box(), flat.offset, flat.count, next_node, leaves);
+            return;
+        }
+
+        uint32_t left = static_cast<uint32_t>(next_node++);
+        uint32_t right = static_cast<uint32_t>(next_node++);
+        unflatten(tree, index + 1, left, next_node, leaves);
+        unflatten(tree, flat.offset, right, next_node, leaves);
+        link_treelet_node(tree, slot, flat.box(), left, right);
+    }
+
+    void split_leaf(treelet_tree& tree, uint32_t slot, const aabb& box, uint32_t first, uint32_t count,
+                    size_t& next_node, std::vector<uint32_t>& leaves) const {
+        if (count == 1) {
+            bvh_node& node = tree.nodes[slot];
+            node.box = aabb::intersection(aabb::from_triangle(m_leaf_triangles[first], m_vertices), box);
+            node.left = nullptr;
+            node.right = nullptr;
+            node.first_primitive = first;
+            node.primitive_count = 1;
+            tree.leaf_counts[slot] = 1;
+            tree.costs[slot] = m_options.intersection_cost * node.box.surface_area();
+            tree.collapsed[slot] = true;
+            leaves.push_back(slot);
+            return;
+        }
+
+        uint32_t left = static_cast<uint32_t>(next_node++);
+        uint32_t right = static_cast<uint32_t>(next_node++);
+        split_leaf(tree, left, box, first, count / 2, next_node, leaves);
+        split_leaf(tree, right, box, first + count / 2, count - count / 2, next_node, leaves);
+        link_treelet_node(tree, slot, aabb::surrounding_box(tree.nodes[left].box, tree.nodes[right].box), left, right);
+    }
+
+    // Interior node cost, or the cost of one leaf over the whole subtree when that is cheaper
+    void link_treelet_node(treelet_tree& tree, uint32_t slot, const aabb& box, uint32_t left, uint32_t right) const {
+        bvh_node& node = tree.nodes[slot];
+        node.box = box;
+        node.left = &tree.nodes[left];
+        node.right = &tree.nodes[right];
+        node.primitive_count = node.left->primitive_count + node.right->primitive_count;
+        tree.parents[left] = slot;
+        tree.parents[right] = slot;
+        tree.leaf_counts[slot] = tree.leaf_counts[left] + tree.leaf_counts[right];
+        set_treelet_cost(tree, slot, tree.costs[left] + tree.costs[right]);
+    }
+
+    void set_treelet_cost(treelet_tree& tree, uint32_t slot, float children_cost) const {
+        const bvh_node& node = tree.nodes[slot];
+        float area = node.box.surface_area();
+        float interior_cost = m_options.traversal_cost * area + children_cost;
+        float leaf_cost = m_options.intersection_cost * node.primitive_count * area;
+        tree.collapsed[slot] = node.primitive_count <= m_options.max_leaf_size && leaf_cost <= interior_cost;
+        tree.costs[slot] = tree.collapsed[slot] ? leaf_cost : interior_cost;
+    }
+
+    // Rebuilds the treelet under root over its largest-area subtrees with the partition of minimal SAH cost,
+    // found by dynamic programming over all subsets of treelet leaves. Returns whether anything changed.
+    bool optimize_treelet(treelet_tree& tree, uint32_t root_index, size_t max_leaves) {
+        bvh_node* root = &tree.nodes[root_index];
+        bvh_node* leaves[8] = {root->left, root->right};
+        bvh_node* internals[6];
+        size_t leaf_count = 2;
+        size_t internal_count = 0;
+
+        while (leaf_count < max_leaves) {
+            int largest = -1;
+            float largest_area = -1.0f;
+            for (size_t i = 0; i < leaf_count; i++) {
+                if (leaves[i]->left != nullptr && leaves[i]->box.surface_area() > largest_area) {
+                    largest = static_cast<int>(i);
+                    largest_area = leaves[i]->box.surface_area();
+                }
+            }
+            if (largest < 0) {
+                break;
+            }
+            bvh_node* opened = leaves[largest];
+            internals[internal_count++] = opened;
+            leaves[largest] = opened->left;
+            leaves[leaf_count++] = opened->right;
+        }
+
+        uint32_t subsets = 1u << leaf_count;
+        aabb boxes[256];
+        float costs[256];
+        uint32_t counts[256];
+        uint8_t splits[256];
+        for (uint32_t s = 1; s < subsets; s++) {
+            uint32_t low = s & (~s + 1);
+            uint32_t leaf = 0;
+            while ((1u << leaf) != low) {
+                leaf++;
+            }
+
+            if (s == low) {
+                boxes[s] = leaves[leaf]->box;
+                costs[s] = tree.costs[tree.index(leaves[leaf])];
+                counts[s] = leaves[leaf]->primitive_count;
+                continue;
+            }
+            boxes[s] = aabb::surrounding_box(boxes[s ^ low], leaves[leaf]->box);
+            counts[s] = counts[s ^ low] + leaves[leaf]->primitive_count;
+
+            // Proper subsets are numerically smaller, so they are already solved. Only partitions
+            // holding the lowest leaf are tried, the other half is the mirror image.
+            float best = std::numeric_limits<float>::infinity();
+            for (uint32_t p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+                if ((p & low) && costs[p] + costs[s ^ p] < best) {
+                    best = costs[p] + costs[s ^ p];
+                    splits[s] = static_cast<uint8_t>(p);
+                }
+            }
+            float area = boxes[s].surface_area();
+            costs[s] = m_options.traversal_cost * area + best;
+            if (counts[s] <= m_options.max_leaf_size) {
+                costs[s] = std::min(costs[s], m_options.intersection_cost * counts[s] * area);
+            }
+        }
+
+        uint32_t all = subsets - 1;
+        if (!(costs[all] < tree.costs[root_index] * (1.0f - 1e-5f))) {
+            return false;
+        }
+
+        size_t next_internal = 0;
+        assign_treelet(tree, root, all, leaves, internals, next_internal, boxes, costs, splits);
+        return true;
+    }
 
-        while (!stack.empty()) {
-            bvh_node* node = stack.top();
-            stack.pop();
+    void assign_treelet(treelet_tree& tree, bvh_node* node, uint32_t subset, bvh_node* const* leaves, bvh_node* const* internals,
+                        size_t& next_internal, const aabb* boxes, const float* costs, const uint8_t* splits) {
+        bvh_node* children[2];
+        uint32_t parts[2] = {splits[subset], subset ^ splits[subset]};
+        for (int side = 0; side < 2; side++) {
+            uint32_t part = parts[side];
+            if ((part & (part - 1)) == 0) {
+                uint32_t leaf = 0;
+                while ((1u << leaf) != part) {
+                    leaf++;
+                }
+                children[side] = leaves[leaf];
+            } else {
+                children[side] = internals[next_internal++];
+                assign_treelet(tree, children[side], part, leaves, internals, next_internal, boxes, costs, splits);
+            }
+            tree.parents[tree.index(children[side])] = tree.index(node);
+        }
+
+        uint32_t index = tree.index(node);
+        node->left = children[0];
+        node->right = children[1];
+        node->box = boxes[subset];
+        node->primitive_count = children[0]->primitive_count + children[1]->primitive_count;
+        tree.leaf_counts[index] = tree.leaf_counts[tree.index(children[0])] + tree.leaf_counts[tree.index(children[1])];
+        set_treelet_cost(tree, index, tree.costs[tree.index(children[0])] + tree.costs[tree.index(children[1])]);
+    }
+
+    // Turns collapsed subtrees into leaves. Only the triangle index of the references is used by finish_build().
+    void collapse_treelets(const treelet_tree& tree, bvh_node* node, std::vector<bvh_primitive>& leaf_references) const {
+        if (!tree.collapsed[tree.index(node)]) {
+            collapse_treelets(tree, node->left, leaf_references);
+            collapse_treelets(tree, node->right, leaf_references);
+            return;
+        }
+
+        uint32_t first = static_cast<uint32_t>(leaf_references.size());
+        gather_primitives(node, leaf_references);
+        node->left = nullptr;
+        node->right = nullptr;
+        node->first_primitive = first;
+    }
+
+    void gather_primitives(const bvh_node* node, std::vector<bvh_primitive>& leaf_references) const {
+        if (node->left != nullptr) {
+            gather_primitives(node->left, leaf_references);
+            gather_primitives(node->right, leaf_references);
+            return;
+        }
+        leaf_references.emplace_back(node->box, m_indices[node->first_primitive]);
+    }
+
+    // leaf_references are the primitives in the order the leaves point into
+    void finish_build(const bvh_node* root, const std::vector<bvh_primitive>& leaf_references,
+                      size_t node_count, size_t collapse_size) {
+        m_nodes.reserve(node_count);
+        m_depth = 0;
+        flatten(root, collapse_size, 1);
+
+        m_indices.resize(leaf_references.size());
+        m_leaf_triangles.clear();
+        m_leaf_triangles.reserve(leaf_references.size());
+        for (size_t i = 0; i < leaf_references.size(); i++) {
+            m_indices[i] = leaf_references[i].triangle_index();
+            m_leaf_triangles.push_back(m_triangles[m_indices[i]]);
+        }
+
+        m_built_sah_cost = sah_cost();
+        m_duplication = static_cast<float>(leaf_references.size()) / static_cast<float>(m_triangles.size());
+
+        m_pool = nullptr;
+        m_build_nodes = nullptr;
+        m_arena.reset();
+    }
+
+    float refit(const std::vector<vec3>& vertices, thread_pool* pool) {
+        if (vertices.size() != m_vertices.size()) {
+            throw std::invalid_argument("Refit needs the same number of vertices the BVH was built with");
+        }
+        get();
+
+        for (size_t i = 0; i < vertices.size(); i++) {
+            m_vertices[i] = vector3{vertices[i].x, vertices[i].y, vertices[i].z};
+        }
+
+        // Split the top of the tree into roughly 4 subtrees per worker
+        std::vector<uint32_t> top_nodes;
+        std::vector<uint32_t> subtrees(1, 0);
+        size_t target = pool != nullptr ? pool->size() * 4 : 1;
+        while (subtrees.size() < target) {
+            auto widest = std::max_element(subtrees.begin(), subtrees.end(), [this](uint32_t a, uint32_t b) {
+                return subtree_end(a) - a < subtree_end(b) - b;
+            });
+            uint32_t node = *widest;
+            if (m_nodes[node].is_leaf()) {
+                break;
+            }
+            top_nodes.push_back(node);
+            *widest = node + 1;
+            subtrees.push_back(m_nodes[node].offset);
+        }
+
+        parallel_for(pool, 0, subtrees.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                refit_range(subtrees[i], subtree_end(subtrees[i]));
+            }
+        });
+
+        // Parents always precede their children in depth-first order
+        std::sort(top_nodes.begin(), top_nodes.end(), std::greater<uint32_t>());
+        for (uint32_t node : top_nodes) {
+            refit_node(node);
+        }
+
+        // Build input for the next build(), leaves may reference a triangle more than once so go by triangle
+        parallel_for(pool, 0, m_primitives.size(), reduction_grain, [this](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                uint32_t index = m_primitives[i].triangle_index();
+                m_primitives[i] = bvh_primitive(simd_aabb::from_triangle(m_triangles[index], m_vertices), index);
+            }
+        });
+
+        return sah_degradation();
+    }
+
+    // One past the last node of the subtree rooted at node
+    uint32_t subtree_end(uint32_t node) const {
+        while (!m_nodes[node].is_leaf()) {
+            node = m_nodes[node].offset;
+        }
+        return node + 1;
+    }
+
+    // Reverse sweep over a whole subtree, children are always refitted before their parent
+    void refit_range(uint32_t begin, uint32_t end) {
+        for (uint32_t node = end; node-- > begin; ) {
+            refit_node(node);
+        }
+    }
+
+    void refit_node(uint32_t index) {
+        linear_bvh_node& node = m_nodes[index];
+        aabb box;
+        if (node.is_leaf()) {
+            simd_aabb leaf_box = simd_aabb::empty();
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                leaf_box.merge(simd_aabb::from_triangle(m_leaf_triangles[i], m_vertices));
+            }
+            box = leaf_box.to_aabb();
+        } else {
+            box = aabb::surrounding_box(m_nodes[index + 1].box(), m_nodes[node.offset].box());
+        }
+        node.min_corner = box.min_corner;
+        node.max_corner = box.max_corner;
+    }
+
+    // Length of the common prefix of keys i and j, ties between equal keys broken by index
+    static int lbvh_delta(const std::vector<uint64_t>& keys, int64_t i, int64_t j) {
+        if (j < 0 || j >= static_cast<int64_t>(keys.size())) {
+            return -1;
+        }
+        if (keys[i] == keys[j]) {
+            return 64 + __builtin_clzll(static_cast<uint64_t>(i ^ j));
+        }
+        return __builtin_clzll(keys[i] ^ keys[j]);
+    }
+
+    // Range of keys covered by internal node i and the last key of its left child
+    static void lbvh_range_and_split(const std::vector<uint64_t>& keys, int64_t i, int64_t& first, int64_t& last, int64_t& split) {
+        int64_t direction = lbvh_delta(keys, i, i + 1) - lbvh_delta(keys, i, i - 1) > 0 ? 1 : -1;
+        int delta_min = lbvh_delta(keys, i, i - direction);
 
-            boxes.push_back(node->box);
+        int64_t length_max = 2;
+        while (lbvh_delta(keys, i, i + length_max * direction) > delta_min) {
+            length_max *= 2;
+        }
 
-            if (node->left) {
-                stack.push(node->left);
+        int64_t length = 0;
+        for (int64_t step = length_max / 2; step >= 1; step /= 2) {
+            if (lbvh_delta(keys, i, i + (length + step) * direction) > delta_min) {
+                length += step;
             }
+        }
+        int64_t j = i + length * direction;
 
-            if (node->right) {
-                stack.push(node->right);
+        int delta_node = lbvh_delta(keys, i, j);
+        int64_t offset = 0;
+        for (int64_t divisor = 2; ; divisor *= 2) {
+            int64_t step = (length + divisor - 1) / divisor;
+            if (lbvh_delta(keys, i, i + (offset + step) * direction) > delta_node) {
+                offset += step;
+            }
+            if (step <= 1) {
+                break;
             }
         }
 
+        split = i + offset * direction + std::min<int64_t>(direction, 0);
+        first = std::min(i, j);
+        last = std::max(i, j);
+    }
+
+    // Min/max merges are exact, so splitting the reduction into chunks cannot change the result
+    aabb bounds(const std::vector<bvh_primitive>& primitives, size_t start, size_t end) const {
+        simd_aabb box = simd_aabb::empty();
+        std::mutex mutex;
+        parallel_for(end - start >= reduction_grain ? m_pool : nullptr, start, end, reduction_grain,
+                     [&](size_t chunk_begin, size_t chunk_end) {
+                         simd_aabb chunk = simd_aabb::empty();
+                         for (size_t i = chunk_begin; i < chunk_end; i++) {
+                             chunk.merge(primitives[i].simd_bounding_box());
+                         }
+                         std::lock_guard<std::mutex> lock(mutex);
+                         box.merge(chunk);
+                     });
+        return box.to_aabb();
+    }
+
+    aabb centroid_bounds(const std::vector<bvh_primitive>& primitives, size_t start, size_t end) const {
+        simd_aabb box = simd_aabb::empty();
+        std::mutex mutex;
+        parallel_for(end - start >= reduction_grain ? m_pool : nullptr, start, end, reduction_grain,
+                     [&](size_t chunk_begin, size_t chunk_end) {
+                         simd_aabb chunk = simd_aabb::empty();
+                         for (size_t i = chunk_begin; i < chunk_end; i++) {
+                             chunk.expand(primitives[i].simd_centroid());
+                         }
+                         std::lock_guard<std::mutex> lock(mutex);
+                         box.merge(chunk);
+                     });
+        return box.to_aabb();
+    }
+
+    static size_t split_median(std::vector<bvh_primitive>& primitives, size_t start, size_t end, const aabb& box) {
+        size_t axis = box.longest_axis();
+        size_t mid = (start + end) / 2;
+        std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end,
+                         [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                             return a.get_centroid().data[axis] < b.get_centroid().data[axis];
+                         });
+        return mid;
+    }
+
+    struct sah_bin {
+        simd_aabb box = simd_aabb::empty();
+        size_t count = 0;
+    };
+
+    // Binned SAH split over all three axes. Returns end when no useful plane exists,
+    // otherwise the partition point, with best_cost set to the cost of the split.
+    size_t split_sah(std::vector<bvh_primitive>& primitives, size_t start, size_t end, const aabb& box, float& best_cost) const {
+        aabb centroid_box = centroid_bounds(primitives, start, end);
+
+        size_t bin_count = m_options.bin_count;
+        float lo[3];
+        float scale[3];
+        for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = centroid_box.min_corner.data[axis];
+            float extent = centroid_box.max_corner.data[axis] - lo[axis];
+            scale[axis] = extent > 0.0f ? static_cast<float>(bin_count) / extent : 0.0f;
+        }
+
+        // Bins of all three axes, filled in one pass over the primitives
+        std::vector<sah_bin> bins(3 * bin_count);
+        std::mutex mutex;
+        parallel_for(end - start >= reduction_grain ? m_pool : nullptr, start, end, reduction_grain,
+                     [&](size_t chunk_begin, size_t chunk_end) {
+                         std::vector<sah_bin> chunk(3 * bin_count);
+                         for (size_t i = chunk_begin; i < chunk_end; i++) {
+                             const simd_aabb& primitive_box = primitives[i].simd_bounding_box();
+                             simd_vector3 centroid = primitive_box.centroid();
+                             for (int axis = 0; axis < 3; axis++) {
+                                 size_t b = axis * bin_count + bin_index(centroid.data[axis], lo[axis], scale[axis], bin_count);
+                                 chunk[b].count++;
+                                 chunk[b].box.merge(primitive_box);
+                             }
+                         }
+                         std::lock_guard<std::mutex> lock(mutex);
+                         for (size_t b = 0; b < bins.size(); b++) {
+                             bins[b].count += chunk[b].count;
+                             bins[b].box.merge(chunk[b].box);
+                         }
+                     });
+
+        std::vector<float> right_area(bin_count);
+        std::vector<size_t> right_count(bin_count);
+
+        float parent_area = box.surface_area();
+        best_cost = std::numeric_limits<float>::infinity();
+        int best_axis = -1;
+        size_t best_split = 0;
+
+        for (int axis = 0; axis < 3; axis++) {
+            if (scale[axis] <= 0.0f) {
+                continue;
+            }
+            const sah_bin* axis_bins = &bins[axis * bin_count];
+
+            // Sweep from the right to get the area and count of every right-hand side
+            simd_aabb right_box = simd_aabb::empty();
+            size_t count = 0;
+            for (size_t b = bin_count - 1; b > 0; b--) {
+                right_box.merge(axis_bins[b].box);
+                count += axis_bins[b].count;
+                right_area[b] = right_box.surface_area();
+                right_count[b] = count;
+            }
+
+            simd_aabb left_box = simd_aabb::empty();
+            count = 0;
+            for (size_t b = 1; b < bin_count; b++) {
+                left_box.merge(axis_bins[b - 1].box);
+                count += axis_bins[b - 1].count;
+                if (count == 0 || right_count[b] == 0) {
+                    continue;
+                }
+
+                float cost = m_options.traversal_cost + m_options.intersection_cost *
+                        (left_box.surface_area() * count + right_area[b] * right_count[b]) / parent_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+
+        if (best_axis < 0 || parent_area <= 0.0f) {
+            best_cost = std::numeric_limits<float>::infinity();
+            return end;
+        }
+
+        float axis_lo = lo[best_axis];
+        float axis_scale = scale[best_axis];
+        auto it = std::partition(primitives.begin() + start, primitives.begin() + end,
+                                 [=](const bvh_primitive& p) {
+                                     return bin_index(p.get_centroid().data[best_axis], axis_lo, axis_scale, bin_count) < best_split;
+                                 });
+        return static_cast<size_t>(it - primitives.begin());
+    }
+
+    static size_t bin_index(float value, float lo, float scale, size_t bin_count) {
+        size_t b = static_cast<size_t>((value - lo) * scale);
+        return std::min(b, bin_count - 1);
+    }
+
+    // Depth-first layout, returns the index of the emitted node.
+    // Subtrees with at most collapse_size primitives become a single leaf.
+    uint32_t flatten(const bvh_node* node, size_t collapse_size, size_t depth) {
+        m_depth = std::max(m_depth, depth);
+        uint32_t index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+        m_nodes[index].min_corner = node->box.min_corner;
+        m_nodes[index].max_corner = node->box.max_corner;
+
+        if (node->left == nullptr || node->primitive_count <= collapse_size) {
+            m_nodes[index].offset = node->first_primitive;
+            m_nodes[index].count = node->primitive_count;
+        } else {
+            flatten(node->left, collapse_size, depth + 1);
+            m_nodes[index].offset = flatten(node->right, collapse_size, depth + 1);
+            m_nodes[index].count = 0;
+        }
+
+        return index;
+    }
+
+public:
+    std::vector<aabb> serialize() {
+        std::vector<aabb> boxes;
+        for (const auto& node : get()) {
+            boxes.push_back(node.box());
+        }
         return boxes;
     }
 
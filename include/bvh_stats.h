@@ -0,0 +1,190 @@
+//
+// Created by mykola on 02.06.24.
+//
+
+#ifndef BVH_BVH_STATS_H
+#define BVH_BVH_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+
+// Quality metrics of a built tree, for comparing builders
+struct bvh_stats {
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    size_t memory_bytes = 0;            // nodes, leaf index array and leaf-ordered triangles
+    float sah_cost = 0.0f;
+    float end_point_overlap = 0.0f;     // Aila et al. 2013, see compute_bvh_stats()
+    float duplication_ratio = 1.0f;
+    std::vector<size_t> depth_histogram;        // leaves per depth, the root is depth 1
+    std::vector<size_t> leaf_size_histogram;    // leaves per primitive count
+};
+
+namespace bvh_stats_detail {
+
+// Area of the part of the triangle inside box (Sutherland-Hodgman against the six slab planes)
+inline float clipped_area(const vector3& v0, const vector3& v1, const vector3& v2, const aabb& box) {
+    std::vector<vector3> polygon{v0, v1, v2};
+    std::vector<vector3> clipped;
+    for (int axis = 0; axis < 3; axis++) {
+        for (int side = 0; side < 2; side++) {
+            float plane = side == 0 ? box.min_corner.data[axis] : box.max_corner.data[axis];
+            float sign = side == 0 ? 1.0f : -1.0f;
+            clipped.clear();
+            for (size_t i = 0; i < polygon.size(); i++) {
+                const vector3& a = polygon[i];
+                const vector3& b = polygon[(i + 1) % polygon.size()];
+                float da = (a.data[axis] - plane) * sign;
+                float db = (b.data[axis] - plane) * sign;
+                if (da >= 0.0f) {
+                    clipped.push_back(a);
+                }
+                if ((da >= 0.0f) != (db >= 0.0f)) {
+                    clipped.push_back(a + (b - a) * (da / (da - db)));
+                }
+            }
+            polygon.swap(clipped);
+            if (polygon.size() < 3) {
+                return 0.0f;
+            }
+        }
+    }
+
+    float x = 0.0f, y = 0.0f, z = 0.0f;
+    for (size_t i = 1; i + 1 < polygon.size(); i++) {
+        vector3 c = (polygon[i] - polygon[0]).cross(polygon[i + 1] - polygon[0]);
+        x += c.data[0];
+        y += c.data[1];
+        z += c.data[2];
+    }
+    return 0.5f * std::sqrt(x * x + y * y + z * z);
+}
+
+inline bool overlaps(const aabb& a, const aabb& b) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (a.max_corner.data[axis] < b.min_corner.data[axis] || b.max_corner.data[axis] < a.min_corner.data[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace bvh_stats_detail
+
+// End-point overlap is the surface area of geometry that lies inside a node's box without
+// belonging to its subtree, summed over all nodes weighted by the traversal or intersection
+// cost and divided by the total triangle area: the expected work spent on nodes a ray ending
+// on a surface did not need to visit. Quadratic in the worst case, meant for offline reports.
+inline bvh_stats compute_bvh_stats(const bvh& tree, float traversal_cost = 1.0f, float intersection_cost = 1.0f) {
+    using namespace bvh_stats_detail;
+    const bvh_node_array& nodes = tree.get();
+    const std::vector<uint32_t>& indices = tree.indices();
+    const std::vector<triangle>& triangles = tree.triangles();
+    const std::vector<vector3>& vertices = tree.vertices();
+
+    bvh_stats stats;
+    stats.node_count = nodes.size();
+    stats.memory_bytes = nodes.size() * sizeof(linear_bvh_node) + indices.size() * sizeof(uint32_t) +
+                         triangles.size() * sizeof(triangle);
+    stats.sah_cost = tree.sah_cost();
+    stats.duplication_ratio = tree.duplication_ratio();
+
+    // Depth of every node, parents come first in depth-first order
+    std::vector<uint32_t> depths(nodes.size(), 1);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].is_leaf()) {
+            stats.leaf_count++;
+            if (stats.depth_histogram.size() <= depths[i]) {
+                stats.depth_histogram.resize(depths[i] + 1);
+            }
+            stats.depth_histogram[depths[i]]++;
+            if (stats.leaf_size_histogram.size() <= nodes[i].count) {
+                stats.leaf_size_histogram.resize(nodes[i].count + 1);
+            }
+            stats.leaf_size_histogram[nodes[i].count]++;
+        } else {
+            depths[i + 1] = depths[i] + 1;
+            depths[nodes[i].offset] = depths[i] + 1;
+        }
+    }
+
+    // Leaf entries of every subtree form a range, children come after their parent
+    std::vector<uint32_t> range_begin(nodes.size());
+    std::vector<uint32_t> range_end(nodes.size());
+    for (size_t i = nodes.size(); i-- > 0;) {
+        if (nodes[i].is_leaf()) {
+            range_begin[i] = nodes[i].offset;
+            range_end[i] = nodes[i].offset + nodes[i].count;
+        } else {
+            range_begin[i] = std::min(range_begin[i + 1], range_begin[nodes[i].offset]);
+            range_end[i] = std::max(range_end[i + 1], range_end[nodes[i].offset]);
+        }
+    }
+
+    // SBVH leaves may share a triangle, every triangle counts once
+    std::vector<bool> counted(indices.empty() ? 0 : *std::max_element(indices.begin(), indices.end()) + 1);
+    double total_area = 0.0;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        if (!counted[indices[i]]) {
+            counted[indices[i]] = true;
+            const vector3& v0 = vertices[triangles[i].vertices_ids[0]];
+            vector3 normal = (vertices[triangles[i].vertices_ids[1]] - v0).cross(vertices[triangles[i].vertices_ids[2]] - v0);
+            total_area += 0.5 * std::sqrt(normal.dot(normal));
+        }
+    }
+    if (total_area <= 0.0) {
+        return stats;
+    }
+
+    auto by_triangle = [&indices](uint32_t a, uint32_t b) { return indices[a] < indices[b]; };
+    auto same_triangle = [&indices](uint32_t a, uint32_t b) { return indices[a] == indices[b]; };
+    std::vector<uint32_t> stack;
+    std::vector<uint32_t> own;
+    std::vector<uint32_t> foreign;
+    double overlap = 0.0;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        aabb box = nodes[n].box();
+        own.assign(indices.begin() + range_begin[n], indices.begin() + range_end[n]);
+        std::sort(own.begin(), own.end());
+
+        foreign.clear();
+        stack.assign(1, 0);
+        while (!stack.empty()) {
+            uint32_t i = stack.back();
+            stack.pop_back();
+            if (!overlaps(nodes[i].box(), box)) {
+                continue;
+            }
+            if (!nodes[i].is_leaf()) {
+                stack.push_back(i + 1);
+                stack.push_back(nodes[i].offset);
+                continue;
+            }
+            for (uint32_t k = nodes[i].offset; k < nodes[i].offset + nodes[i].count; k++) {
+                if ((k < range_begin[n] || k >= range_end[n]) && !std::binary_search(own.begin(), own.end(), indices[k])) {
+                    foreign.push_back(k);
+                }
+            }
+        }
+
+        std::sort(foreign.begin(), foreign.end(), by_triangle);
+        foreign.erase(std::unique(foreign.begin(), foreign.end(), same_triangle), foreign.end());
+        double foreign_area = 0.0;
+        for (uint32_t k : foreign) {
+            const triangle& tri = triangles[k];
+            foreign_area += clipped_area(vertices[tri.vertices_ids[0]], vertices[tri.vertices_ids[1]],
+                                         vertices[tri.vertices_ids[2]], box);
+        }
+
+        float cost = nodes[n].is_leaf() ? intersection_cost * nodes[n].count : traversal_cost;
+        overlap += cost * foreign_area;
+    }
+    stats.end_point_overlap = static_cast<float>(overlap / total_area);
+    return stats;
+}
+
+#endif //BVH_BVH_STATS_H
@@ -0,0 +1,274 @@
+//
+// Created by mykola on 28.05.24.
+//
+
+#ifndef BVH_COMPRESSED_BVH_H
+#define BVH_COMPRESSED_BVH_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "wide_bvh.h"
+
+// Wide node with child boxes quantized to 8 bits per plane (Ylitie et al. 2017).
+// A child plane decodes to origin + q * 2^exponent. The encoder rounds every q outwards and checks
+// it against that same float expression, so decoded boxes always contain the original ones.
+// Interior children are stored consecutively from child_base, the primitives of the leaf
+// children consecutively from primitive_base, in slot order.
+template <int Width>
+struct alignas(16) compressed_bvh_node {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t leaf_mask;          // bit per slot, empty slots are leaves without primitives
+    uint32_t child_base;
+    uint32_t primitive_base;
+    uint8_t count[Width];
+    uint8_t q_lo_x[Width];
+    uint8_t q_lo_y[Width];
+    uint8_t q_lo_z[Width];
+    uint8_t q_hi_x[Width];
+    uint8_t q_hi_y[Width];
+    uint8_t q_hi_z[Width];
+
+    bool is_leaf(int slot) const {
+        return (leaf_mask >> slot) & 1u;
+    }
+
+    // 2^exponent built directly from the exponent bits
+    static float scale(int8_t exponent) {
+        uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    void decode(wide_bvh_node<Width>& out) const {
+        float sx = scale(exponent[0]);
+        float sy = scale(exponent[1]);
+        float sz = scale(exponent[2]);
+        for (int slot = 0; slot < Width; slot++) {
+            out.min_x[slot] = origin[0] + static_cast<float>(q_lo_x[slot]) * sx;
+            out.min_y[slot] = origin[1] + static_cast<float>(q_lo_y[slot]) * sy;
+            out.min_z[slot] = origin[2] + static_cast<float>(q_lo_z[slot]) * sz;
+            out.max_x[slot] = origin[0] + static_cast<float>(q_hi_x[slot]) * sx;
+            out.max_y[slot] = origin[1] + static_cast<float>(q_hi_y[slot]) * sy;
+            out.max_z[slot] = origin[2] + static_cast<float>(q_hi_z[slot]) * sz;
+        }
+    }
+};
+
+static_assert(sizeof(compressed_bvh_node<8>) == 80, "compressed 8-wide node must stay 80 bytes");
+
+// Compressed copy of a wide_bvh. Keeps its own leaf-ordered triangle list, vertices are
+// read from the source bvh, which must outlive this object.
+template <int Width>
+class compressed_bvh {
+public:
+    using node = compressed_bvh_node<Width>;
+
+private:
+    const bvh& m_source;
+    std::vector<node, aligned_allocator<node, 16>> m_nodes;
+    std::vector<triangle> m_triangles;
+    std::vector<uint32_t> m_indices;
+
+    struct traversal_entry {
+        uint32_t child;
+        uint32_t count;
+        float t_near;
+    };
+
+public:
+    explicit compressed_bvh(const wide_bvh<Width>& wide): m_source(wide.source()) {
+        encode(wide);
+    }
+
+    const std::vector<node, aligned_allocator<node, 16>>& nodes() const {
+        return m_nodes;
+    }
+
+    size_t memory_bytes() const {
+        return m_nodes.size() * sizeof(node);
+    }
+
+    // Closest hit in (r.tmin, r.tmax), same traversal as wide_bvh on the decoded boxes
+    bool intersect(const ray& r, hit_record& hit) const {
+        wide_bvh_detail::ray_data data(r);
+        float tmax = std::min(r.tmax, hit.t);
+        const std::vector<vector3>& vertices = m_source.vertices();
+
+        size_t capacity = m_source.depth() * (Width - 1) + Width;
+        traversal_entry local_stack[bvh::traversal_stack_size];
+        std::vector<traversal_entry> heap_stack;
+        traversal_entry* stack = local_stack;
+        if (capacity > bvh::traversal_stack_size) {
+            heap_stack.resize(capacity);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = traversal_entry{0, 0, r.tmin};
+        bool found = false;
+        wide_bvh_node<Width> decoded;
+        alignas(32) float t_near[Width];
+
+        while (size > 0) {
+            traversal_entry entry = stack[--size];
+            if (entry.t_near > tmax) {
+                continue;
+            }
+
+            if (entry.count > 0) {
+                for (uint32_t i = entry.child; i < entry.child + entry.count; i++) {
+                    const triangle& tri = m_triangles[i];
+                    float t, u, v;
+                    if (intersect_triangle(r, vertices[tri.vertices_ids[0]], vertices[tri.vertices_ids[1]],
+                                           vertices[tri.vertices_ids[2]], tmax, t, u, v)) {
+                        tmax = t;
+                        hit.t = t;
+                        hit.u = u;
+                        hit.v = v;
+                        hit.triangle = m_indices[i];
+                        found = true;
+                    }
+                }
+                continue;
+            }
+
+            const node& n = m_nodes[entry.child];
+            n.decode(decoded);
+            unsigned mask = wide_bvh_detail::intersect_boxes(decoded, data, r.tmin, tmax, t_near);
+
+            uint32_t next_child = n.child_base;
+            uint32_t next_primitive = n.primitive_base;
+            size_t first = size;
+            for (int slot = 0; slot < Width; slot++) {
+                traversal_entry child{0, 0, t_near[slot]};
+                if (n.is_leaf(slot)) {
+                    child.child = next_primitive;
+                    child.count = n.count[slot];
+                    next_primitive += n.count[slot];
+                } else {
+                    child.child = next_child++;
+                }
+                if (!(mask & (1u << slot)) || (n.is_leaf(slot) && child.count == 0)) {
+                    continue;
+                }
+
+                size_t i = size++;
+                while (i > first && stack[i - 1].t_near < child.t_near) {
+                    stack[i] = stack[i - 1];
+                    i--;
+                }
+                stack[i] = child;
+            }
+        }
+
+        return found;
+    }
+
+private:
+    // Breadth-first so that the interior children of every node get consecutive indices
+    void encode(const wide_bvh<Width>& wide) {
+        const auto& wide_nodes = wide.nodes();
+        const std::vector<triangle>& triangles = m_source.triangles();
+        const std::vector<uint32_t>& indices = m_source.indices();
+
+        std::vector<uint32_t> queue(1, 0);
+        m_nodes.resize(1);
+        for (size_t head = 0; head < queue.size(); head++) {
+            const wide_bvh_node<Width>& in = wide_nodes[queue[head]];
+            node out;
+            std::memset(&out, 0, sizeof(out));
+            out.child_base = static_cast<uint32_t>(m_nodes.size());
+            out.primitive_base = static_cast<uint32_t>(m_triangles.size());
+
+            for (int slot = 0; slot < Width; slot++) {
+                if (in.is_empty(slot)) {
+                    out.leaf_mask |= 1u << slot;
+                } else if (in.is_leaf(slot)) {
+                    if (in.count[slot] > 255) {
+                        throw std::runtime_error("Compressed BVH leaves hold at most 255 primitives");
+                    }
+                    out.leaf_mask |= 1u << slot;
+                    out.count[slot] = static_cast<uint8_t>(in.count[slot]);
+                    for (uint32_t i = in.child[slot]; i < in.child[slot] + in.count[slot]; i++) {
+                        m_triangles.push_back(triangles[i]);
+                        m_indices.push_back(indices[i]);
+                    }
+                } else {
+                    queue.push_back(in.child[slot]);
+                    m_nodes.emplace_back();
+                }
+            }
+
+            quantize(in, out);
+            m_nodes[head] = out;
+        }
+    }
+
+    static void quantize(const wide_bvh_node<Width>& in, node& out) {
+        const float* mins[3] = {in.min_x, in.min_y, in.min_z};
+        const float* maxs[3] = {in.max_x, in.max_y, in.max_z};
+        uint8_t* q_lo[3] = {out.q_lo_x, out.q_lo_y, out.q_lo_z};
+        uint8_t* q_hi[3] = {out.q_hi_x, out.q_hi_y, out.q_hi_z};
+
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = std::numeric_limits<float>::infinity();
+            float hi = -std::numeric_limits<float>::infinity();
+            for (int slot = 0; slot < Width; slot++) {
+                if (!in.is_empty(slot)) {
+                    lo = std::min(lo, mins[axis][slot]);
+                    hi = std::max(hi, maxs[axis][slot]);
+                }
+            }
+            if (lo > hi) {
+                lo = hi = 0.0f;
+            }
+            out.origin[axis] = lo;
+
+            // Smallest power of two step that spans the node in 255 steps; grow it if rounding does not fit
+            int exponent = hi > lo ? static_cast<int>(std::ceil(std::log2((hi - lo) / 255.0f))) : -126;
+            exponent = std::max(exponent, -126);
+            while (!quantize_axis(in, lo, exponent, mins[axis], maxs[axis], q_lo[axis], q_hi[axis])) {
+                if (++exponent > 127) {
+                    throw std::runtime_error("Compressed BVH node is too large to quantize");
+                }
+            }
+            out.exponent[axis] = static_cast<int8_t>(exponent);
+        }
+    }
+
+    static bool quantize_axis(const wide_bvh_node<Width>& in, float origin, int exponent,
+                              const float* mins, const float* maxs, uint8_t* q_lo, uint8_t* q_hi) {
+        float step = node::scale(static_cast<int8_t>(exponent));
+        for (int slot = 0; slot < Width; slot++) {
+            if (in.is_empty(slot)) {
+                // Inverted box, never reported as a hit with a non-zero direction component
+                q_lo[slot] = 255;
+                q_hi[slot] = 0;
+                continue;
+            }
+
+            float lo = std::floor((mins[slot] - origin) / step);
+            float hi = std::ceil((maxs[slot] - origin) / step);
+            lo = std::max(lo, 0.0f);
+            while (lo > 0.0f && origin + lo * step > mins[slot]) {
+                lo -= 1.0f;
+            }
+            while (origin + hi * step < maxs[slot]) {
+                hi += 1.0f;
+            }
+            if (lo > 255.0f || hi > 255.0f) {
+                return false;
+            }
+            q_lo[slot] = static_cast<uint8_t>(lo);
+            q_hi[slot] = static_cast<uint8_t>(hi);
+        }
+        return true;
+    }
+};
+
+#endif //BVH_COMPRESSED_BVH_H
@@ -0,0 +1,44 @@
+//
+// Created by mykola on 26.05.24.
+//
+
+#ifndef BVH_CPU_FEATURES_H
+#define BVH_CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BVH_X86 1
+#include <immintrin.h>
+#endif
+
+// Kernels that need more than SSE2 are compiled per function with __attribute__((target(...)))
+// and picked at run time, so one binary runs on every x86-64 machine.
+#if defined(BVH_X86) && defined(__GNUC__)
+#define BVH_TARGET_AVX __attribute__((target("avx")))
+#define BVH_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define BVH_TARGET_AVX
+#define BVH_TARGET_AVX2
+#endif
+
+struct cpu_features {
+    bool avx = false;
+    bool avx2 = false;
+
+    static const cpu_features& get() {
+        static const cpu_features features = detect();
+        return features;
+    }
+
+private:
+    static cpu_features detect() {
+        cpu_features features;
+#if defined(BVH_X86) && defined(__GNUC__)
+        __builtin_cpu_init();
+        features.avx = __builtin_cpu_supports("avx");
+        features.avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+        return features;
+    }
+};
+
+#endif //BVH_CPU_FEATURES_H
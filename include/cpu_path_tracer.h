@@ -0,0 +1,649 @@
+//
+// Created by mykola on 04.06.24.
+//
+
+#ifndef BVH_CPU_PATH_TRACER_H
+#define BVH_CPU_PATH_TRACER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "blocked_bvh.h"
+#include "bvh.h"
+#include "image.h"
+#include "light_table.h"
+#include "morton.h"
+#include "radix_sort.h"
+#include "ray_packet.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+// Values match the REFLECTION_* constants of path_tracer.cs
+enum class reflection_type : uint32_t {
+    specular = 0,
+    diffuse = 1,
+    refractive = 2
+};
+
+// The shader gives every triangle this material (see FindHit)
+struct material {
+    vector3 emission{1.0f, 1.0f, 1.0f};
+    vector3 color{0.5f, 0.5f, 0.1f};
+    reflection_type type = reflection_type::diffuse;
+};
+
+// Adaptive sampling (cpu_path_tracer::render_adaptive, adaptive = true in path_tracer.cs): a pixel stops
+// taking samples once the estimated relative standard error of its mean luminance is below
+// error_threshold, but not before min_samples and never beyond max_samples
+struct adaptive_sampling_options {
+    int min_samples = 16;
+    int max_samples = 1024;
+    float error_threshold = 0.05f;
+};
+
+// CPU port of the integrator in path_tracer.cs, for machines without a GPU and as a reference
+// for the shader. Differences: hits come from the bvh over the whole scene (leaves intersected as
+// SIMD triangle blocks) instead of a brute force loop over every triangle, and the
+// determinant epsilon of intersect_triangle is used. triangle_test::watertight matches the
+// shader with watertight = true, set_next_event_estimation(true) the one with next_event = true.
+class cpu_path_tracer {
+public:
+    static constexpr float pi = 3.14159265358979323846f;
+    static constexpr float hit_epsilon = 1e-3f;     // FindHit rejects t <= 1e-3 and ignores the ray's tmin
+    static constexpr float refractive_index_out = 1.0f;
+    static constexpr float refractive_index_in = 1.5f;
+
+    // The tiled renderer traces camera rays of packet_side x packet_side pixels as one packet
+    static const int packet_side = 4;
+    static const int packet_size = packet_side * packet_side;
+
+private:
+    // Per-thread scratch of the tiled renderer, on its own cache lines
+    struct alignas(64) worker_context {
+        path_sampler rng[packet_size];
+        ray_packet<packet_size> packet;
+        std::vector<vector3> tile;
+    };
+
+    const scene& m_scene;
+    const bvh& m_bvh;
+    blocked_bvh m_blocks;
+    std::vector<material> m_materials;
+    image m_image;
+    int m_frame = 0;
+    sampler_type m_sampler = sampler_type::random;
+    bool m_next_event = false;
+    bool m_lights_dirty = true;
+    light_table m_lights;
+    std::vector<worker_context, aligned_allocator<worker_context, 64>> m_workers;
+
+    // Wavefront mode: one live path per pixel of the current frame
+    struct path_state {
+        vector3 origin;
+        vector3 direction;
+        vector3 L;
+        vector3 F;
+        hit_record hit;
+        path_sampler rng;
+        uint32_t pixel;
+        bool count_emission;
+        bool alive;
+    };
+
+    std::vector<path_state> m_paths;
+    std::vector<path_state> m_sorted_paths;
+    std::vector<uint64_t> m_ray_keys;
+    std::vector<uint32_t> m_ray_order;
+    std::vector<uint32_t> m_shade_order;
+    std::vector<vector3> m_radiance;
+
+    // Adaptive mode: per pixel mean of the squared luminance (alpha of texture0) and sample count
+    std::vector<float> m_luminance_moment;
+    std::vector<uint32_t> m_sample_count;
+
+public:
+    cpu_path_tracer(const scene& s, const bvh& tree, int width = 280, int height = 280,
+                    triangle_test test = triangle_test::moller_trumbore)
+            : m_scene(s), m_bvh(tree), m_blocks(tree, 0, test), m_materials(s.get_triangles().size()),
+              m_image(width, height) {}
+
+    void set_material(uint32_t triangle_index, const material& m) {
+        m_materials.at(triangle_index) = m;
+        m_lights_dirty = true;
+    }
+
+    // Next-event estimation: every diffuse vertex samples one emissive triangle from an alias table
+    // over the material emissions (light_table) and adds its light if a shadow ray reaches it. A hit
+    // on an emitter right after a diffuse vertex then adds nothing, the light sample accounted for it.
+    void set_next_event_estimation(bool enabled) {
+        m_next_event = enabled;
+    }
+
+    // sampler_type::random (default) reproduces the shader with sobol = false, sampler_type::sobol
+    // the one with sobol = true. Switch it before the first frame, not in between.
+    void set_sampler(sampler_type type) {
+        m_sampler = type;
+    }
+
+    // One sample per pixel, blended into the image like main() in path_tracer.cs: frame n
+    // (counting from 1) is seeded with time = n and gets weight 1 / (n + 1)
+    void render_frame(thread_pool* pool = nullptr) {
+        update_lights();
+        m_frame++;
+        int width = m_image.width();
+        parallel_for(pool, 0, static_cast<size_t>(m_image.height()), 1, [&](size_t begin, size_t end) {
+            path_sampler rng;
+            for (size_t y = begin; y < end; y++) {
+                for (int x = 0; x < width; x++) {
+                    accumulate(m_image.at(x, static_cast<int>(y)), x, static_cast<int>(y), m_frame, rng);
+                }
+            }
+        });
+    }
+
+    // Renders frames samples per pixel tile by tile. Each worker blends all of them into its own
+    // copy of the tile and writes it back once. Camera rays go through the bvh as packets of
+    // 4x4 pixels, the rest of every path is traced alone. The result equals calling render_frame()
+    // frames times.
+    void render(int frames, tile_scheduler& scheduler, thread_pool& pool) {
+        update_lights();
+        if (m_workers.size() != pool.size() + 1) {
+            m_workers.resize(pool.size() + 1);
+        }
+
+        int first_frame = m_frame + 1;
+        scheduler.run(pool, [&](const render_tile& tile, size_t worker) -> uint64_t {
+            worker_context& context = m_workers[worker];
+            context.tile.resize(static_cast<size_t>(tile.width) * tile.height);
+            for (int y = 0; y < tile.height; y++) {
+                std::copy(&m_image.at(tile.x, tile.y + y), &m_image.at(tile.x, tile.y + y) + tile.width,
+                          context.tile.begin() + y * tile.width);
+            }
+
+            for (int frame = first_frame; frame < first_frame + frames; frame++) {
+                for (int py = 0; py < tile.height; py += packet_side) {
+                    for (int px = 0; px < tile.width; px += packet_side) {
+                        int y_end = std::min(py + packet_side, tile.height);
+                        int x_end = std::min(px + packet_side, tile.width);
+                        ray_packet<packet_size>& packet = context.packet;
+                        packet.clear();
+                        for (int y = py; y < y_end; y++) {
+                            for (int x = px; x < x_end; x++) {
+                                path_sampler& rng = context.rng[packet.size];
+                                seed(rng, tile.x + x, tile.y + y, frame, static_cast<uint32_t>(frame - 1));
+                                packet.add(camera_ray(tile.x + x, tile.y + y, rng));
+                            }
+                        }
+
+                        m_blocks.intersect(packet);
+                        int lane = 0;
+                        for (int y = py; y < y_end; y++) {
+                            for (int x = px; x < x_end; x++, lane++) {
+                                vector3 hdr = radiance(packet.get(lane), packet.hits[lane], context.rng[lane]);
+                                vector3& mean = context.tile[y * tile.width + x];
+                                mean += (hdr - mean) / static_cast<float>(frame + 1);
+                            }
+                        }
+                    }
+                }
+            }
+
+            for (int y = 0; y < tile.height; y++) {
+                std::copy(context.tile.begin() + y * tile.width, context.tile.begin() + (y + 1) * tile.width,
+                          &m_image.at(tile.x, tile.y + y));
+            }
+            return static_cast<uint64_t>(tile.width) * tile.height * frames;
+        });
+        m_frame += frames;
+    }
+
+    // Renders frames samples per pixel bounce by bounce instead of path by path: every bounce
+    // sorts the live rays by direction octant and origin cell, traces them as one stream and
+    // shades the hits grouped by reflection type. Paths keep their own RNG, so the image is the
+    // same as with render_frame().
+    void render_wavefront(int frames, thread_pool* pool = nullptr) {
+        for (int i = 0; i < frames; i++) {
+            render_wavefront_frame(pool);
+        }
+    }
+
+    void render_wavefront_frame(thread_pool* pool = nullptr) {
+        update_lights();
+        m_frame++;
+        int width = m_image.width();
+        size_t pixel_count = static_cast<size_t>(width) * m_image.height();
+        m_paths.resize(pixel_count);
+        m_radiance.assign(pixel_count, vector3{0.0f, 0.0f, 0.0f});
+
+        parallel_for(pool, 0, pixel_count, wavefront_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                path_state& path = m_paths[i];
+                int x = static_cast<int>(i % width);
+                int y = static_cast<int>(i / width);
+                seed(path.rng, x, y, m_frame, static_cast<uint32_t>(m_frame - 1));
+                ray r = camera_ray(x, y, path.rng);
+                path.origin = r.origin;
+                path.direction = r.direction;
+                path.L = vector3{0.0f, 0.0f, 0.0f};
+                path.F = vector3{1.0f, 1.0f, 1.0f};
+                path.pixel = static_cast<uint32_t>(i);
+                path.count_emission = true;
+                path.alive = true;
+            }
+        });
+
+        for (uint32_t depth = 0; !m_paths.empty(); depth++) {
+            sort_rays(pool);
+
+            parallel_for(pool, 0, m_paths.size(), wavefront_grain, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    path_state& path = m_paths[i];
+                    path.hit = hit_record();
+                    m_blocks.intersect(ray(path.origin, path.direction, hit_epsilon), path.hit);
+                }
+            });
+
+            group_by_material();
+            parallel_for(pool, 0, m_shade_order.size(), wavefront_grain, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    shade(m_paths[m_shade_order[i]], depth);
+                }
+            });
+
+            m_paths.erase(std::remove_if(m_paths.begin(), m_paths.end(),
+                                         [](const path_state& path) { return !path.alive; }), m_paths.end());
+        }
+
+        parallel_for(pool, 0, pixel_count, wavefront_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                vector3& mean = m_image.at(static_cast<int>(i % width), static_cast<int>(i / width));
+                mean += (m_radiance[i] - mean) / static_cast<float>(m_frame + 1);
+            }
+        });
+    }
+
+    void render(int frames, thread_pool* pool = nullptr) {
+        for (int i = 0; i < frames; i++) {
+            render_frame(pool);
+        }
+    }
+
+    // Adaptive version of render(): each frame only pixels that are not converged() take a sample.
+    // A pixel's value is the plain mean of its own samples. Meant for a fresh tracer, the frame
+    // counter only seeds the RNG. Stops early once every pixel converged, returns the samples taken.
+    uint64_t render_adaptive(int frames, const adaptive_sampling_options& options, thread_pool* pool = nullptr) {
+        uint64_t total = 0;
+        for (int i = 0; i < frames; i++) {
+            uint64_t samples = render_adaptive_frame(options, pool);
+            if (samples == 0) {
+                break;
+            }
+            total += samples;
+        }
+        return total;
+    }
+
+    uint64_t render_adaptive_frame(const adaptive_sampling_options& options, thread_pool* pool = nullptr) {
+        update_lights();
+        m_frame++;
+        int width = m_image.width();
+        size_t pixel_count = static_cast<size_t>(width) * m_image.height();
+        m_luminance_moment.resize(pixel_count, 0.0f);
+        m_sample_count.resize(pixel_count, 0);
+
+        std::atomic<uint64_t> total(0);
+        parallel_for(pool, 0, static_cast<size_t>(m_image.height()), 1, [&](size_t begin, size_t end) {
+            path_sampler rng;
+            uint64_t samples = 0;
+            for (size_t y = begin; y < end; y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t i = y * width + x;
+                    if (converged(i, options)) {
+                        continue;
+                    }
+                    seed(rng, x, static_cast<int>(y), m_frame, m_sample_count[i]);
+                    vector3 hdr = radiance(camera_ray(x, static_cast<int>(y), rng), rng);
+                    float n = static_cast<float>(m_sample_count[i] + 1);
+                    float l = luminance(hdr);
+                    vector3& mean = m_image.at(x, static_cast<int>(y));
+                    mean += (hdr - mean) / n;
+                    m_luminance_moment[i] += (l * l - m_luminance_moment[i]) / n;
+                    m_sample_count[i]++;
+                    samples++;
+                }
+            }
+            total.fetch_add(samples, std::memory_order_relaxed);
+        });
+        return total.load();
+    }
+
+    // Converged() of path_tracer.cs for pixel i = y * width + x
+    bool converged(size_t i, const adaptive_sampling_options& options) const {
+        uint32_t samples = m_sample_count[i];
+        if (samples < static_cast<uint32_t>(std::max(options.min_samples, 2))) {
+            return false;
+        }
+        if (samples >= static_cast<uint32_t>(options.max_samples)) {
+            return true;
+        }
+        float n = static_cast<float>(samples);
+        const vector3& mean = m_image.at(static_cast<int>(i % m_image.width()), static_cast<int>(i / m_image.width()));
+        float mean_luminance = luminance(mean);
+        float variance = std::max(m_luminance_moment[i] - mean_luminance * mean_luminance, 0.0f) * n / (n - 1.0f);
+        return std::sqrt(variance / n) < options.error_threshold * std::max(mean_luminance, 1e-3f);
+    }
+
+    // Samples taken so far by pixel (x, y) in adaptive mode
+    uint32_t sample_count(int x, int y) const {
+        size_t i = static_cast<size_t>(y) * m_image.width() + x;
+        return i < m_sample_count.size() ? m_sample_count[i] : 0;
+    }
+
+    // Rec. 709 luminance, as Luminance() in path_tracer.cs
+    static float luminance(const vector3& c) {
+        return 0.2126f * c.data[0] + 0.7152f * c.data[1] + 0.0722f * c.data[2];
+    }
+
+    const image& get_image() const {
+        return m_image;
+    }
+
+    int frame() const {
+        return m_frame;
+    }
+
+    // One step of main() in path_tracer.cs for pixel (x, y) of the given frame
+    void accumulate(vector3& mean, int x, int y, int frame, path_sampler& rng) const {
+        seed(rng, x, y, frame, static_cast<uint32_t>(frame - 1));
+        vector3 hdr = radiance(camera_ray(x, y, rng), rng);
+        mean += (hdr - mean) / static_cast<float>(frame + 1);
+    }
+
+    // Sampler setup of main() in path_tracer.cs: the white noise is seeded with
+    // Hash(index ^ floatBitsToUint(time)), time = frame, and the Sobol points are picked by sample_index
+    void seed(path_sampler& rng, int x, int y, int frame, uint32_t sample_index) const {
+        float time = static_cast<float>(frame);
+        uint32_t time_bits;
+        std::memcpy(&time_bits, &time, sizeof(time_bits));
+        uint32_t pixel = static_cast<uint32_t>(y * m_image.width() + x);
+        rng.start(m_sampler, pixel ^ time_bits, pixel, sample_index);
+    }
+
+    // Jittered camera ray of CalculateRadiance(vec2 fragCoord, inout Sampler state)
+    ray camera_ray(int x, int y, path_sampler& rng) const {
+        const vector3 eye{0.0f, 10.0f, 200.6f};
+        const float fov = 0.4135f;
+        float width = static_cast<float>(m_image.width());
+        float height = static_cast<float>(m_image.height());
+
+        vector3 camera_direction = vector3{0.0f, 0.1f, -1.0f}.normalize();
+        vector3 camera_x{width * fov / height, 0.0f, 0.0f};
+        vector3 camera_y = camera_x.cross(camera_direction).normalize() * fov;
+
+        float u1 = rng.next_float();
+        float u2 = rng.next_float();
+        float cs_x = (static_cast<float>(x) + u1) / width - 0.5f;
+        float cs_y = (static_cast<float>(y) + u2) / height - 0.5f;
+        vector3 d = camera_x * cs_x + camera_y * cs_y + camera_direction;
+        return ray(eye + d * 130.0f, d.normalize(), hit_epsilon);
+    }
+
+    // CalculateRadiance(Ray ray, inout Sampler state). As in the shader a path that leaves the
+    // scene returns black, dropping what it gathered so far, except with next-event estimation:
+    // there the light samples taken on the way would be lost with it.
+    vector3 radiance(const ray& r, path_sampler& rng) const {
+        hit_record hit;
+        m_blocks.intersect(r, hit);
+        return radiance(r, hit, rng);
+    }
+
+    // Same, for a ray whose closest hit was already found
+    vector3 radiance(ray r, hit_record hit, path_sampler& rng) const {
+        vector3 L{0.0f, 0.0f, 0.0f};
+        vector3 F{1.0f, 1.0f, 1.0f};
+        bool count_emission = true;
+
+        for (uint32_t depth = 0;; depth++) {
+            if (!hit.hit()) {
+                return next_event() ? L : vector3{0.0f, 0.0f, 0.0f};
+            }
+            if (!scatter(r, hit, depth, L, F, count_emission, rng)) {
+                return L;
+            }
+            hit = hit_record();
+            m_blocks.intersect(r, hit);
+        }
+    }
+
+    // One bounce of the CalculateRadiance loop at hit: gathers emission (unless count_emission is
+    // false), plays Russian roulette, adds a light sample at diffuse vertices with next-event estimation
+    // and replaces r with the continuation ray. False when roulette ends the path.
+    bool scatter(ray& r, const hit_record& hit, uint32_t depth, vector3& L, vector3& F, bool& count_emission,
+                 path_sampler& rng) const {
+        rng.start_bounce(depth);
+        const material& m = m_materials[hit.triangle];
+        if (count_emission) {
+            L += F * m.emission;
+        }
+        F = F * m.color;
+
+        if (depth > 4) {
+            float continue_probability = m.color.max_component();
+            if (rng.next_float() >= continue_probability) {
+                return false;
+            }
+            F = F / continue_probability;
+        }
+
+        const std::vector<vector3>& vertices = m_bvh.vertices();
+        const triangle& tri = m_scene.get_triangles()[hit.triangle];
+        const vector3& v0 = vertices[tri.vertices_ids[0]];
+        vector3 n = (vertices[tri.vertices_ids[1]] - v0).cross(vertices[tri.vertices_ids[2]] - v0).normalize();
+        vector3 p = r.at(hit.t);
+
+        vector3 d;
+        count_emission = true;
+        switch (m.type) {
+            case reflection_type::specular:
+                d = reflect(r.direction, n);
+                break;
+
+            case reflection_type::refractive: {
+                float pr;
+                d = specular_transmit(r.direction, n, pr, rng);
+                F = F * pr;
+                break;
+            }
+
+            default: {
+                vector3 w = n.dot(r.direction) < 0.0f ? n : -n;
+                vector3 axis = std::fabs(w.data[0]) > 0.1f ? vector3{0.0f, 1.0f, 0.0f} : vector3{1.0f, 0.0f, 0.0f};
+                vector3 u = axis.cross(w).normalize();
+                vector3 v = w.cross(u);
+                float u1 = rng.next_float();
+                float u2 = rng.next_float();
+                vector3 s = cosine_hemisphere_sample(u1, u2);
+                d = (u * s.data[0] + v * s.data[1] + w * s.data[2]).normalize();
+                if (next_event()) {
+                    rng.start_light_sample(depth);
+                    L += F * sample_light(p, w, rng);
+                    count_emission = false;
+                }
+                break;
+            }
+        }
+        r = ray(p, d, hit_epsilon);
+        return true;
+    }
+
+    // SampleLight() of path_tracer.cs: emission reaching the diffuse vertex p (w is the normal on the
+    // side of the incoming ray) from one point on one light, times cos / pi over the pdf of the point.
+    // F times this is the light sample's contribution, F already holds the albedo.
+    vector3 sample_light(const vector3& p, const vector3& w, path_sampler& rng) const {
+        const light_entry& light = m_lights.pick(rng.next_float());
+        float u1 = rng.next_float();
+        float u2 = rng.next_float();
+
+        const std::vector<vector3>& vertices = m_bvh.vertices();
+        const triangle& tri = m_scene.get_triangles()[light.triangle];
+        const vector3& v0 = vertices[tri.vertices_ids[0]];
+        const vector3& v1 = vertices[tri.vertices_ids[1]];
+        const vector3& v2 = vertices[tri.vertices_ids[2]];
+        vector3 q = light_table::sample_triangle(v0, v1, v2, u1, u2);
+        vector3 nl = (v1 - v0).cross(v2 - v0).normalize();
+
+        vector3 d = q - p;
+        float distance2 = d.dot(d);
+        float distance = std::sqrt(distance2);
+        d = d / distance;
+        float cos_p = w.dot(d);
+        float cos_l = std::fabs(nl.dot(d));
+        if (!(cos_p > 0.0f && cos_l > 0.0f)) {
+            return vector3{0.0f, 0.0f, 0.0f};
+        }
+        if (m_blocks.occluded(ray(p, d, hit_epsilon), distance - hit_epsilon)) {
+            return vector3{0.0f, 0.0f, 0.0f};
+        }
+        return m_materials[light.triangle].emission * (cos_p * cos_l / (pi * distance2 * light.pdf));
+    }
+
+    static vector3 reflect(const vector3& direction, const vector3& normal) {
+        return direction - normal * (2.0f * normal.dot(direction));
+    }
+
+    static vector3 cosine_hemisphere_sample(float u1, float u2) {
+        float cos_theta = std::sqrt(1.0f - u1);
+        float sin_theta = std::sqrt(u1);
+        float phi = 2.0f * pi * u2;
+        return vector3{std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta};
+    }
+
+    static float schlick_reflectance(float n1, float n2, float c) {
+        float sqrt_r0 = (n1 - n2) / (n1 + n2);
+        float r0 = sqrt_r0 * sqrt_r0;
+        return r0 + (1.0f - r0) * c * c * c * c * c;
+    }
+
+    // IdealSpecularTransmit: picks reflection or refraction, pr is the weight of the chosen lobe
+    static vector3 specular_transmit(const vector3& direction, const vector3& normal, float& pr, path_sampler& rng) {
+        vector3 reflected = reflect(direction, normal);
+
+        bool out_to_in = normal.dot(direction) < 0.0f;
+        vector3 nl = out_to_in ? normal : -normal;
+        float nn = out_to_in ? refractive_index_out / refractive_index_in : refractive_index_in / refractive_index_out;
+        float cos_theta = direction.dot(nl);
+        float cos2_phi = 1.0f - nn * nn * (1.0f - cos_theta * cos_theta);
+
+        if (cos2_phi < 0.0f) {
+            pr = 1.0f;
+            return reflected;
+        }
+
+        vector3 transmitted = (direction * nn - nl * (nn * cos_theta + std::sqrt(cos2_phi))).normalize();
+        float c = 1.0f - (out_to_in ? -cos_theta : transmitted.dot(normal));
+
+        float re = schlick_reflectance(refractive_index_out, refractive_index_in, c);
+        float p_re = 0.25f + 0.5f * re;
+        if (rng.next_float() < p_re) {
+            pr = re / p_re;
+            return reflected;
+        }
+        pr = (1.0f - re) / (1.0f - p_re);
+        return transmitted;
+    }
+
+private:
+    static const size_t wavefront_grain = 1024;
+
+    bool next_event() const {
+        return m_next_event && !m_lights.empty();
+    }
+
+    // Rebuilds the light table from the material emissions after set_material()
+    void update_lights() {
+        if (m_next_event && m_lights_dirty) {
+            std::vector<vector3> emissions(m_materials.size());
+            for (size_t i = 0; i < m_materials.size(); i++) {
+                emissions[i] = m_materials[i].emission;
+            }
+            m_lights = m_scene.get_light_table(emissions);
+            m_lights_dirty = false;
+        }
+    }
+
+    // Reorders m_paths by direction octant, then by the Morton cell of the ray origin (8 bits per
+    // axis over the scene bounds), so neighbouring rays in the stream walk the same part of the tree
+    void sort_rays(thread_pool* pool) {
+        aabb bounds = m_bvh.get()[0].box();
+        size_t count = m_paths.size();
+        m_ray_keys.resize(count);
+        m_ray_order.resize(count);
+        parallel_for(pool, 0, count, wavefront_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const path_state& path = m_paths[i];
+                uint64_t octant = (path.direction.data[0] < 0.0f ? 4u : 0u) | (path.direction.data[1] < 0.0f ? 2u : 0u) |
+                                  (path.direction.data[2] < 0.0f ? 1u : 0u);
+                m_ray_keys[i] = (octant << 24) | (morton_code_30(path.origin, bounds) >> 6);
+                m_ray_order[i] = static_cast<uint32_t>(i);
+            }
+        });
+        radix_sort_pairs(m_ray_keys, m_ray_order, 27, pool);
+
+        m_sorted_paths.resize(count);
+        parallel_for(pool, 0, count, wavefront_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                m_sorted_paths[i] = m_paths[m_ray_order[i]];
+            }
+        });
+        m_paths.swap(m_sorted_paths);
+    }
+
+    // Counting sort of the paths by the reflection type at their hit, misses first
+    void group_by_material() {
+        const size_t bucket_count = 4;
+        size_t counts[bucket_count] = {0, 0, 0, 0};
+        for (const path_state& path : m_paths) {
+            counts[material_bucket(path)]++;
+        }
+        size_t offsets[bucket_count] = {0, 0, 0, 0};
+        for (size_t b = 1; b < bucket_count; b++) {
+            offsets[b] = offsets[b - 1] + counts[b - 1];
+        }
+        m_shade_order.resize(m_paths.size());
+        for (size_t i = 0; i < m_paths.size(); i++) {
+            m_shade_order[offsets[material_bucket(m_paths[i])]++] = static_cast<uint32_t>(i);
+        }
+    }
+
+    size_t material_bucket(const path_state& path) const {
+        return path.hit.hit() ? 1 + static_cast<size_t>(m_materials[path.hit.triangle].type) : 0;
+    }
+
+    // Same as one iteration of radiance(), a finished path writes its pixel
+    void shade(path_state& path, uint32_t depth) {
+        if (!path.hit.hit()) {
+            if (next_event()) {
+                m_radiance[path.pixel] = path.L;
+            }
+            path.alive = false;
+            return;
+        }
+        ray r(path.origin, path.direction, hit_epsilon);
+        if (!scatter(r, path.hit, depth, path.L, path.F, path.count_emission, path.rng)) {
+            m_radiance[path.pixel] = path.L;
+            path.alive = false;
+            return;
+        }
+        path.origin = r.origin;
+        path.direction = r.direction;
+    }
+};
+
+#endif //BVH_CPU_PATH_TRACER_H
@@ -0,0 +1,421 @@
+//
+// Created by mykola on 03.06.24.
+//
+
+#ifndef BVH_DYNAMIC_BVH_H
+#define BVH_DYNAMIC_BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.h"
+
+struct dynamic_bvh_node {
+    // Enumerators, unlike static const members, never need an out-of-class definition
+    enum : uint32_t { null_node = 0xffffffffu };
+
+    aabb box;
+    uint32_t parent = null_node;
+    uint32_t left = null_node;
+    uint32_t right = null_node;
+    uint32_t primitive = null_node;     // triangle id of a leaf
+
+    bool is_leaf() const {
+        return left == null_node;
+    }
+};
+
+// Binary bvh with one triangle per leaf that supports inserting and removing single triangles.
+// A new leaf is paired with the sibling that increases the total node area the least, found by
+// branch and bound (Bittner et al. 2015); on the way back to the root every node gets a tree
+// rotation if one shrinks it (Kopta et al. 2012). Removal splices out the leaf's parent and
+// walks up the same way. Triangle ids stay valid until they are removed; removed ids are not reused.
+// A triangle that moves is removed and inserted again with its new vertices.
+class dynamic_bvh {
+public:
+    enum : uint32_t { null_node = dynamic_bvh_node::null_node };
+
+private:
+    std::vector<vector3> m_vertices;
+    std::vector<triangle> m_triangles;  // by triangle id
+    std::vector<uint32_t> m_leaves;     // leaf node of every triangle id, null_node once removed
+    std::vector<dynamic_bvh_node> m_nodes;
+    std::vector<uint32_t> m_free_nodes;
+    uint32_t m_root = null_node;
+    size_t m_size = 0;
+
+    struct candidate {
+        uint32_t node;
+        float inherited_cost;
+
+        bool operator<(const candidate& other) const {
+            return inherited_cost > other.inherited_cost;
+        }
+    };
+
+public:
+    dynamic_bvh() = default;
+
+    // Starts from the topology of a built bvh, leaves holding several triangles are split up.
+    // Triangle ids are the original triangle indices of source.
+    explicit dynamic_bvh(const bvh& source): m_vertices(source.vertices()) {
+        const std::vector<uint32_t>& indices = source.indices();
+        const std::vector<triangle>& triangles = source.triangles();
+        size_t count = indices.empty() ? 0 : *std::max_element(indices.begin(), indices.end()) + 1;
+        m_triangles.resize(count);
+        m_leaves.assign(count, null_node);
+        for (size_t i = 0; i < indices.size(); i++) {
+            m_triangles[indices[i]] = triangles[i];
+        }
+
+        m_nodes.reserve(2 * count);
+        std::vector<bool> seen(count, false);
+        m_root = import(source.get(), indices, 0, seen);
+        if (m_root != null_node) {
+            m_nodes[m_root].parent = null_node;
+        }
+    }
+
+    // Adds a triangle over existing vertices, returns its id
+    uint32_t insert(const triangle& tri) {
+        for (uint32_t vertex : tri.vertices_ids) {
+            if (vertex >= m_vertices.size()) {
+                throw std::out_of_range("Triangle references a vertex that does not exist");
+            }
+        }
+
+        uint32_t id = static_cast<uint32_t>(m_triangles.size());
+        m_triangles.push_back(tri);
+        m_leaves.push_back(null_node);
+        insert_leaf(id);
+        return id;
+    }
+
+    // Adds a triangle together with its own three vertices, returns its id
+    uint32_t insert(const vector3& v0, const vector3& v1, const vector3& v2) {
+        uint32_t base = static_cast<uint32_t>(m_vertices.size());
+        m_vertices.push_back(v0);
+        m_vertices.push_back(v1);
+        m_vertices.push_back(v2);
+        return insert(triangle(base, base + 1, base + 2));
+    }
+
+    void remove(uint32_t id) {
+        if (id >= m_leaves.size() || m_leaves[id] == null_node) {
+            throw std::out_of_range("Triangle is not in the BVH");
+        }
+        remove_leaf(m_leaves[id]);
+        m_leaves[id] = null_node;
+        m_size--;
+    }
+
+    bool contains(uint32_t id) const {
+        return id < m_leaves.size() && m_leaves[id] != null_node;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    const std::vector<vector3>& vertices() const {
+        return m_vertices;
+    }
+
+    const triangle& get_triangle(uint32_t id) const {
+        return m_triangles[id];
+    }
+
+    uint32_t root() const {
+        return m_root;
+    }
+
+    const std::vector<dynamic_bvh_node>& nodes() const {
+        return m_nodes;
+    }
+
+    // Same cost model as bvh::sah_cost() with unit costs, comparable to a tree built with max_leaf_size = 1
+    float sah_cost() const {
+        if (m_root == null_node || m_nodes[m_root].box.surface_area() <= 0.0f) {
+            return 0.0f;
+        }
+
+        float cost = 0.0f;
+        std::vector<uint32_t> stack(1, m_root);
+        while (!stack.empty()) {
+            const dynamic_bvh_node& node = m_nodes[stack.back()];
+            stack.pop_back();
+            cost += node.box.surface_area();
+            if (!node.is_leaf()) {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+        return cost / m_nodes[m_root].box.surface_area();
+    }
+
+    // Closest hit in (r.tmin, r.tmax), near child first. hit.triangle is the triangle id.
+    bool intersect(const ray& r, hit_record& hit) const {
+        if (m_root == null_node) {
+            return false;
+        }
+
+        vector3 inv_direction = r.inv_direction();
+        float tmax = std::min(r.tmax, hit.t);
+        float t_near;
+        if (!m_nodes[m_root].box.intersect(r.origin, inv_direction, r.tmin, tmax, t_near)) {
+            return false;
+        }
+
+        // Insertion order decides the depth, so the stack grows on the heap when needed
+        std::vector<std::pair<uint32_t, float>> stack;
+        stack.reserve(bvh::traversal_stack_size);
+        stack.emplace_back(m_root, t_near);
+        bool found = false;
+
+        while (!stack.empty()) {
+            std::pair<uint32_t, float> entry = stack.back();
+            stack.pop_back();
+            if (entry.second > tmax) {
+                continue;
+            }
+            const dynamic_bvh_node& node = m_nodes[entry.first];
+
+            if (node.is_leaf()) {
+                const triangle& tri = m_triangles[node.primitive];
+                float t, u, v;
+                if (intersect_triangle(r, m_vertices[tri.vertices_ids[0]], m_vertices[tri.vertices_ids[1]],
+                                       m_vertices[tri.vertices_ids[2]], tmax, t, u, v)) {
+                    tmax = t;
+                    hit.t = t;
+                    hit.u = u;
+                    hit.v = v;
+                    hit.triangle = node.primitive;
+                    found = true;
+                }
+                continue;
+            }
+
+            float t_left, t_right;
+            bool hit_left = m_nodes[node.left].box.intersect(r.origin, inv_direction, r.tmin, tmax, t_left);
+            bool hit_right = m_nodes[node.right].box.intersect(r.origin, inv_direction, r.tmin, tmax, t_right);
+            if (hit_left && hit_right) {
+                if (t_left < t_right) {
+                    stack.emplace_back(node.right, t_right);
+                    stack.emplace_back(node.left, t_left);
+                } else {
+                    stack.emplace_back(node.left, t_left);
+                    stack.emplace_back(node.right, t_right);
+                }
+            } else if (hit_left) {
+                stack.emplace_back(node.left, t_left);
+            } else if (hit_right) {
+                stack.emplace_back(node.right, t_right);
+            }
+        }
+
+        return found;
+    }
+
+private:
+    uint32_t allocate_node() {
+        if (!m_free_nodes.empty()) {
+            uint32_t index = m_free_nodes.back();
+            m_free_nodes.pop_back();
+            m_nodes[index] = dynamic_bvh_node();
+            return index;
+        }
+        m_nodes.emplace_back();
+        return static_cast<uint32_t>(m_nodes.size() - 1);
+    }
+
+    uint32_t make_leaf(uint32_t id) {
+        uint32_t index = allocate_node();
+        m_nodes[index].box = aabb::from_triangle(m_triangles[id], m_vertices);
+        m_nodes[index].primitive = id;
+        m_leaves[id] = index;
+        m_size++;
+        return index;
+    }
+
+    // New parent over two subtrees, either of which may be null_node
+    uint32_t join(uint32_t left, uint32_t right) {
+        if (left == null_node || right == null_node) {
+            return left == null_node ? right : left;
+        }
+        uint32_t index = allocate_node();
+        m_nodes[index].left = left;
+        m_nodes[index].right = right;
+        m_nodes[index].box = aabb::surrounding_box(m_nodes[left].box, m_nodes[right].box);
+        m_nodes[left].parent = index;
+        m_nodes[right].parent = index;
+        return index;
+    }
+
+    // Returns null_node for subtrees left without triangles, SBVH duplicates are kept once
+    uint32_t import(const bvh_node_array& flat, const std::vector<uint32_t>& indices, uint32_t index, std::vector<bool>& seen) {
+        const linear_bvh_node& source = flat[index];
+        if (!source.is_leaf()) {
+            uint32_t left = import(flat, indices, index + 1, seen);
+            uint32_t right = import(flat, indices, source.offset, seen);
+            return join(left, right);
+        }
+
+        uint32_t subtree = null_node;
+        for (uint32_t i = source.offset; i < source.offset + source.count; i++) {
+            if (!seen[indices[i]]) {
+                seen[indices[i]] = true;
+                subtree = join(subtree, make_leaf(indices[i]));
+            }
+        }
+        return subtree;
+    }
+
+    void insert_leaf(uint32_t id) {
+        uint32_t leaf = make_leaf(id);
+        if (m_root == null_node) {
+            m_root = leaf;
+            return;
+        }
+
+        uint32_t sibling = find_best_sibling(m_nodes[leaf].box);
+        uint32_t old_parent = m_nodes[sibling].parent;
+        uint32_t parent = join(sibling, leaf);
+        m_nodes[parent].parent = old_parent;
+        if (old_parent == null_node) {
+            m_root = parent;
+            return;
+        }
+
+        dynamic_bvh_node& grandparent = m_nodes[old_parent];
+        if (grandparent.left == sibling) {
+            grandparent.left = parent;
+        } else {
+            grandparent.right = parent;
+        }
+        refit_upwards(old_parent);
+    }
+
+    // Cost of pairing with a node is the area of the new parent plus the growth of all its ancestors.
+    // A subtree is skipped once even its smallest possible cost, the leaf area plus the growth so far,
+    // cannot beat the best candidate.
+    uint32_t find_best_sibling(const aabb& box) const {
+        float leaf_area = box.surface_area();
+        uint32_t best = m_root;
+        float best_cost = aabb::surrounding_box(m_nodes[m_root].box, box).surface_area();
+
+        std::priority_queue<candidate> queue;
+        queue.push(candidate{m_root, 0.0f});
+        while (!queue.empty()) {
+            candidate current = queue.top();
+            queue.pop();
+            if (current.inherited_cost + leaf_area >= best_cost) {
+                break;
+            }
+
+            const dynamic_bvh_node& node = m_nodes[current.node];
+            float direct = aabb::surrounding_box(node.box, box).surface_area();
+            float cost = direct + current.inherited_cost;
+            if (cost < best_cost) {
+                best = current.node;
+                best_cost = cost;
+            }
+
+            float inherited = cost - node.box.surface_area();
+            if (!node.is_leaf() && inherited + leaf_area < best_cost) {
+                queue.push(candidate{node.left, inherited});
+                queue.push(candidate{node.right, inherited});
+            }
+        }
+        return best;
+    }
+
+    void remove_leaf(uint32_t leaf) {
+        m_free_nodes.push_back(leaf);
+        if (leaf == m_root) {
+            m_root = null_node;
+            return;
+        }
+
+        uint32_t parent = m_nodes[leaf].parent;
+        uint32_t sibling = m_nodes[parent].left == leaf ? m_nodes[parent].right : m_nodes[parent].left;
+        uint32_t grandparent = m_nodes[parent].parent;
+        m_free_nodes.push_back(parent);
+        m_nodes[sibling].parent = grandparent;
+        if (grandparent == null_node) {
+            m_root = sibling;
+            return;
+        }
+
+        if (m_nodes[grandparent].left == parent) {
+            m_nodes[grandparent].left = sibling;
+        } else {
+            m_nodes[grandparent].right = sibling;
+        }
+        refit_upwards(grandparent);
+    }
+
+    void refit_upwards(uint32_t index) {
+        while (index != null_node) {
+            dynamic_bvh_node& node = m_nodes[index];
+            node.box = aabb::surrounding_box(m_nodes[node.left].box, m_nodes[node.right].box);
+            rotate(index);
+            index = m_nodes[index].parent;
+        }
+    }
+
+    // Tries swapping each child with a grandchild under the other child and applies the swap that
+    // shrinks the other child's box the most. The node's own box does not change.
+    void rotate(uint32_t index) {
+        uint32_t children[2] = {m_nodes[index].left, m_nodes[index].right};
+        float best_gain = 0.0f;
+        int best_child = -1;
+        int best_grandchild = -1;
+
+        for (int child = 0; child < 2; child++) {
+            uint32_t other = children[1 - child];
+            const dynamic_bvh_node& other_node = m_nodes[other];
+            if (other_node.is_leaf()) {
+                continue;
+            }
+            uint32_t grandchildren[2] = {other_node.left, other_node.right};
+            for (int grandchild = 0; grandchild < 2; grandchild++) {
+                aabb rotated = aabb::surrounding_box(m_nodes[children[child]].box, m_nodes[grandchildren[1 - grandchild]].box);
+                float gain = other_node.box.surface_area() - rotated.surface_area();
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best_child = child;
+                    best_grandchild = grandchild;
+                }
+            }
+        }
+        if (best_child < 0) {
+            return;
+        }
+
+        uint32_t moved_up = children[best_child];
+        uint32_t other = children[1 - best_child];
+        dynamic_bvh_node& other_node = m_nodes[other];
+        uint32_t moved_down = best_grandchild == 0 ? other_node.left : other_node.right;
+
+        if (best_grandchild == 0) {
+            other_node.left = moved_up;
+        } else {
+            other_node.right = moved_up;
+        }
+        m_nodes[moved_up].parent = other;
+        other_node.box = aabb::surrounding_box(m_nodes[other_node.left].box, m_nodes[other_node.right].box);
+
+        if (best_child == 0) {
+            m_nodes[index].left = moved_down;
+        } else {
+            m_nodes[index].right = moved_down;
+        }
+        m_nodes[moved_down].parent = index;
+    }
+};
+
+#endif //BVH_DYNAMIC_BVH_H
@@ -0,0 +1,85 @@
+//
+// Created by mykola on 04.06.24.
+//
+
+#ifndef BVH_IMAGE_H
+#define BVH_IMAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "vector3.h"
+
+// Linear RGB float image. Row 0 is the bottom row, as in the compute shader's texture0.
+class image {
+    int m_width;
+    int m_height;
+    std::vector<vector3> m_pixels;
+
+public:
+    image(int width, int height): m_width(width), m_height(height), m_pixels(static_cast<size_t>(width) * height) {}
+
+    int width() const {
+        return m_width;
+    }
+
+    int height() const {
+        return m_height;
+    }
+
+    vector3& at(int x, int y) {
+        return m_pixels[static_cast<size_t>(y) * m_width + x];
+    }
+
+    const vector3& at(int x, int y) const {
+        return m_pixels[static_cast<size_t>(y) * m_width + x];
+    }
+
+    // .pfm keeps the floats for comparing renders, anything else is written as an 8-bit .ppm
+    // clamped to [0, 1] the same way the screen quad shows the texture
+    void save(const std::string& filename) const {
+        if (filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0) {
+            save_pfm(filename);
+        } else {
+            save_ppm(filename);
+        }
+    }
+
+    void save_ppm(const std::string& filename) const {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file");
+        }
+
+        file << "P6\n" << m_width << " " << m_height << "\n255\n";
+        std::vector<unsigned char> row(static_cast<size_t>(m_width) * 3);
+        for (int y = m_height - 1; y >= 0; y--) {
+            for (int x = 0; x < m_width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float value = std::min(std::max(at(x, y).data[c], 0.0f), 1.0f);
+                    row[x * 3 + c] = static_cast<unsigned char>(value * 255.0f + 0.5f);
+                }
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+    }
+
+    // PFM rows go bottom to top, a negative scale marks little-endian floats
+    void save_pfm(const std::string& filename) const {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file");
+        }
+
+        file << "PF\n" << m_width << " " << m_height << "\n-1.0\n";
+        for (const auto& pixel : m_pixels) {
+            file.write(reinterpret_cast<const char*>(pixel.data), sizeof(pixel.data));
+        }
+    }
+};
+
+#endif //BVH_IMAGE_H
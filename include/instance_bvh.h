@@ -0,0 +1,204 @@
+//
+// Created by mykola on 01.06.24.
+//
+
+#ifndef BVH_INSTANCE_BVH_H
+#define BVH_INSTANCE_BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+#include "transform.h"
+
+// A placement of a shared bottom-level bvh in the world
+struct bvh_instance {
+    const bvh* object;
+    transform3x4 object_to_world;
+    transform3x4 world_to_object;
+
+    bvh_instance(const bvh& object, const transform3x4& object_to_world)
+            : object(&object), object_to_world(object_to_world), world_to_object(object_to_world.inverse()) {}
+
+    aabb world_box() const {
+        return object_to_world.apply_box(object->get()[0].box());
+    }
+};
+
+// Top-level bvh over instances. Bottom-level trees are only referenced, so repeating a mesh costs
+// one bvh_instance instead of a copy of its geometry. The bottom-level trees must be built before
+// and outlive this object.
+class instance_bvh {
+    std::vector<bvh_instance> m_instances;
+    bvh_node_array m_nodes;
+    std::vector<uint32_t> m_order;      // leaf slot -> index of the instance passed in
+    size_t m_depth = 0;
+
+public:
+    explicit instance_bvh(const std::vector<bvh_instance>& instances): m_instances(instances) {
+        build();
+    }
+
+    // Top-level nodes use the binary bvh layout, a leaf covers [offset, offset + count) of order()
+    const bvh_node_array& nodes() const {
+        return m_nodes;
+    }
+
+    const std::vector<uint32_t>& order() const {
+        return m_order;
+    }
+
+    const std::vector<bvh_instance>& instances() const {
+        return m_instances;
+    }
+
+    size_t depth() const {
+        return m_depth;
+    }
+
+    // Top-level nodes and instances only, bottom-level trees are shared
+    size_t memory_bytes() const {
+        return m_nodes.size() * sizeof(linear_bvh_node) + m_instances.size() * sizeof(bvh_instance) +
+               m_order.size() * sizeof(uint32_t);
+    }
+
+    // Closest hit over all instances. The ray is moved into object space for every instance it reaches;
+    // the direction is not renormalized, so t stays comparable between instances. hit.triangle is the
+    // triangle of the instance's bvh, hit.instance the instance index.
+    bool intersect(const ray& r, hit_record& hit) const {
+        if (m_nodes.empty()) {
+            return false;
+        }
+
+        vector3 inv_direction = r.inv_direction();
+        float t_near;
+        if (!m_nodes[0].box().intersect(r.origin, inv_direction, r.tmin, std::min(r.tmax, hit.t), t_near)) {
+            return false;
+        }
+
+        uint32_t local_stack[bvh::traversal_stack_size];
+        std::vector<uint32_t> heap_stack;
+        uint32_t* stack = local_stack;
+        if (m_depth >= bvh::traversal_stack_size) {
+            heap_stack.resize(m_depth + 1);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = 0;
+        bool found = false;
+
+        while (size > 0) {
+            const linear_bvh_node& node = m_nodes[stack[--size]];
+            float tmax = std::min(r.tmax, hit.t);
+            if (!node.box().intersect(r.origin, inv_direction, r.tmin, tmax, t_near)) {
+                continue;
+            }
+
+            if (node.is_leaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    const bvh_instance& instance = m_instances[m_order[i]];
+                    ray local(instance.world_to_object.apply_point(r.origin),
+                              instance.world_to_object.apply_vector(r.direction), r.tmin, r.tmax);
+                    if (instance.object->intersect(local, hit)) {
+                        hit.instance = m_order[i];
+                        found = true;
+                    }
+                }
+                continue;
+            }
+
+            stack[size++] = node.offset;
+            stack[size++] = static_cast<uint32_t>(&node - m_nodes.data()) + 1;
+        }
+
+        return found;
+    }
+
+private:
+    // Full-sweep SAH over the longest centroid axis, one instance per leaf. Instance counts are
+    // small next to triangle counts, so the sort per node is affordable.
+    void build() {
+        m_nodes.clear();
+        m_order.clear();
+        if (m_instances.empty()) {
+            return;
+        }
+
+        std::vector<bvh_primitive> primitives;
+        primitives.reserve(m_instances.size());
+        for (size_t i = 0; i < m_instances.size(); i++) {
+            primitives.emplace_back(m_instances[i].world_box(), static_cast<uint32_t>(i));
+        }
+
+        m_nodes.reserve(2 * primitives.size() - 1);
+        m_depth = 0;
+        build_recursive(primitives, 0, primitives.size(), 1);
+        for (const auto& primitive : primitives) {
+            m_order.push_back(primitive.triangle_index());
+        }
+    }
+
+    uint32_t build_recursive(std::vector<bvh_primitive>& primitives, size_t start, size_t end, size_t depth) {
+        m_depth = std::max(m_depth, depth);
+        uint32_t index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+
+        aabb box = aabb::empty();
+        aabb centroid_box = aabb::empty();
+        for (size_t i = start; i < end; i++) {
+            box = aabb::surrounding_box(box, primitives[i].bounding_box());
+            centroid_box.expand(primitives[i].get_centroid());
+        }
+        m_nodes[index].min_corner = box.min_corner;
+        m_nodes[index].max_corner = box.max_corner;
+
+        if (end - start == 1) {
+            m_nodes[index].offset = static_cast<uint32_t>(start);
+            m_nodes[index].count = 1;
+            return index;
+        }
+
+        vector3 extent = centroid_box.max_corner - centroid_box.min_corner;
+        int axis = 0;
+        if (extent.data[1] > extent.data[axis]) {
+            axis = 1;
+        }
+        if (extent.data[2] > extent.data[axis]) {
+            axis = 2;
+        }
+        std::sort(primitives.begin() + start, primitives.begin() + end,
+                  [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                      return a.get_centroid().data[axis] < b.get_centroid().data[axis];
+                  });
+
+        // Right-to-left areas, then the left-to-right sweep picks the cheapest split
+        size_t count = end - start;
+        std::vector<float> right_area(count);
+        aabb right = aabb::empty();
+        for (size_t i = count; i-- > 1;) {
+            right = aabb::surrounding_box(right, primitives[start + i].bounding_box());
+            right_area[i] = right.surface_area();
+        }
+
+        size_t mid = start + count / 2;
+        float best_cost = std::numeric_limits<float>::infinity();
+        aabb left = aabb::empty();
+        for (size_t i = 1; i < count; i++) {
+            left = aabb::surrounding_box(left, primitives[start + i - 1].bounding_box());
+            float cost = left.surface_area() * static_cast<float>(i) + right_area[i] * static_cast<float>(count - i);
+            if (cost < best_cost) {
+                best_cost = cost;
+                mid = start + i;
+            }
+        }
+
+        build_recursive(primitives, start, mid, depth + 1);
+        m_nodes[index].offset = build_recursive(primitives, mid, end, depth + 1);
+        m_nodes[index].count = 0;
+        return index;
+    }
+};
+
+#endif //BVH_INSTANCE_BVH_H
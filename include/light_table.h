@@ -0,0 +1,127 @@
+//
+// Created by mykola on 10.06.24.
+//
+
+#ifndef BVH_LIGHT_TABLE_H
+#define BVH_LIGHT_TABLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "triangle.h"
+#include "vector3.h"
+
+// One entry of the alias table, laid out as LightEntry in path_tracer.cs (std430, 16 bytes).
+// The entry picked first is kept with probability, otherwise alias is taken instead.
+// triangle and pdf belong to the entry itself: pdf is the probability density per unit area of
+// a point sampled on that triangle, power share / area.
+struct light_entry {
+    float probability;
+    uint32_t alias;
+    uint32_t triangle;
+    float pdf;
+};
+
+// Emissive triangles of a scene with an alias table (Walker, built with Vose's method) over their
+// power, luminance of the emission times area, so a light is picked in O(1) with one random number.
+class light_table {
+    std::vector<light_entry> m_entries;
+    float m_total_power = 0.0f;
+
+public:
+    light_table() = default;
+
+    // emissions holds one emission per triangle; black and degenerate triangles are left out
+    light_table(const std::vector<triangle>& triangles, const std::vector<vector3>& vertices,
+                const std::vector<vector3>& emissions) {
+        std::vector<float> power;
+        for (uint32_t i = 0; i < triangles.size(); i++) {
+            const vector3& v0 = vertices[triangles[i].vertices_ids[0]];
+            const vector3& v1 = vertices[triangles[i].vertices_ids[1]];
+            const vector3& v2 = vertices[triangles[i].vertices_ids[2]];
+            vector3 c = (v1 - v0).cross(v2 - v0);
+            float area = 0.5f * std::sqrt(c.dot(c));
+            float p = luminance(emissions[i]) * area;
+            if (p > 0.0f) {
+                m_entries.push_back(light_entry{1.0f, static_cast<uint32_t>(m_entries.size()), i, 1.0f / area});
+                power.push_back(p);
+                m_total_power += p;
+            }
+        }
+        for (size_t i = 0; i < m_entries.size(); i++) {
+            m_entries[i].pdf *= power[i] / m_total_power;
+        }
+        build_alias(power);
+    }
+
+    bool empty() const {
+        return m_entries.empty();
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    const std::vector<light_entry>& entries() const {
+        return m_entries;
+    }
+
+    float total_power() const {
+        return m_total_power;
+    }
+
+    // Light for u in [0, 1): the integer part of u * size() picks the entry, the fraction decides
+    // between it and its alias
+    const light_entry& pick(float u) const {
+        float scaled = u * static_cast<float>(m_entries.size());
+        uint32_t i = std::min(static_cast<uint32_t>(scaled), static_cast<uint32_t>(m_entries.size() - 1));
+        const light_entry& entry = m_entries[i];
+        return scaled - static_cast<float>(i) < entry.probability ? entry : m_entries[entry.alias];
+    }
+
+    // Uniform point on the triangle (v0, v1, v2) for u1, u2 in [0, 1)
+    static vector3 sample_triangle(const vector3& v0, const vector3& v1, const vector3& v2, float u1, float u2) {
+        float su = std::sqrt(u1);
+        return v0 * (1.0f - su) + v1 * (su * (1.0f - u2)) + v2 * (su * u2);
+    }
+
+    // Rec. 709
+    static float luminance(const vector3& c) {
+        return 0.2126f * c.data[0] + 0.7152f * c.data[1] + 0.0722f * c.data[2];
+    }
+
+private:
+    // Vose: entries with less than the average weight are topped up by one with more, which
+    // becomes their alias and gives up the difference
+    void build_alias(const std::vector<float>& power) {
+        size_t n = m_entries.size();
+        std::vector<float> scaled(n);
+        std::vector<uint32_t> small;
+        std::vector<uint32_t> large;
+        for (uint32_t i = 0; i < n; i++) {
+            scaled[i] = power[i] / m_total_power * static_cast<float>(n);
+            (scaled[i] < 1.0f ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back();
+            uint32_t l = large.back();
+            small.pop_back();
+            large.pop_back();
+            m_entries[s].probability = scaled[s];
+            m_entries[s].alias = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+            (scaled[l] < 1.0f ? small : large).push_back(l);
+        }
+        // What is left is 1 up to rounding
+        for (uint32_t i : small) {
+            m_entries[i].probability = 1.0f;
+        }
+        for (uint32_t i : large) {
+            m_entries[i].probability = 1.0f;
+        }
+    }
+};
+
+#endif //BVH_LIGHT_TABLE_H
@@ -0,0 +1,62 @@
+//
+// Created by mykola on 30.05.24.
+//
+
+#ifndef BVH_MAPPED_FILE_H
+#define BVH_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file. is_open() is false when the file is missing or empty.
+class mapped_file {
+    void* m_data = nullptr;
+    size_t m_size = 0;
+
+public:
+    explicit mapped_file(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                m_data = data;
+                m_size = static_cast<size_t>(info.st_size);
+            }
+        }
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+        if (m_data != nullptr) {
+            ::munmap(m_data, m_size);
+        }
+    }
+
+    bool is_open() const {
+        return m_data != nullptr;
+    }
+
+    // Page aligned
+    const unsigned char* data() const {
+        return static_cast<const unsigned char*>(m_data);
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+};
+
+#endif //BVH_MAPPED_FILE_H
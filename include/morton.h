@@ -0,0 +1,76 @@
+//
+// Created by mykola on 22.05.24.
+//
+
+#ifndef BVH_MORTON_H
+#define BVH_MORTON_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "aabb.h"
+
+// Spread the low 10 bits of v so there are two zero bits between each of them
+inline uint32_t morton_expand_bits_10(uint32_t v) {
+    v &= 0x3ffu;
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v << 8)) & 0x0300f00fu;
+    v = (v | (v << 4)) & 0x030c30c3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+}
+
+// Spread the low 21 bits of v so there are two zero bits between each of them
+inline uint64_t morton_expand_bits_21(uint64_t v) {
+    v &= 0x1fffffull;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+// Spread the low 16 bits of v so there is one zero bit between each of them
+inline uint32_t morton_expand_bits_16(uint32_t v) {
+    v &= 0xffffu;
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+// 32-bit code of a 2D grid cell, 16 bits per axis
+inline uint32_t morton_code_2d(uint32_t x, uint32_t y) {
+    return (morton_expand_bits_16(y) << 1) | morton_expand_bits_16(x);
+}
+
+inline uint32_t morton_quantize(float value, float lo, float scale, uint32_t max_value) {
+    float q = (value - lo) * scale;
+    return static_cast<uint32_t>(std::min(std::max(q, 0.0f), static_cast<float>(max_value)));
+}
+
+// 30-bit code of a point inside bounds, 10 bits per axis
+inline uint64_t morton_code_30(const vector3& point, const aabb& bounds) {
+    uint32_t q[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = bounds.max_corner.data[axis] - bounds.min_corner.data[axis];
+        float scale = extent > 0.0f ? 1024.0f / extent : 0.0f;
+        q[axis] = morton_quantize(point.data[axis], bounds.min_corner.data[axis], scale, 1023);
+    }
+    return (morton_expand_bits_10(q[0]) << 2) | (morton_expand_bits_10(q[1]) << 1) | morton_expand_bits_10(q[2]);
+}
+
+// 63-bit code of a point inside bounds, 21 bits per axis
+inline uint64_t morton_code_63(const vector3& point, const aabb& bounds) {
+    uint32_t q[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = bounds.max_corner.data[axis] - bounds.min_corner.data[axis];
+        float scale = extent > 0.0f ? 2097152.0f / extent : 0.0f;
+        q[axis] = morton_quantize(point.data[axis], bounds.min_corner.data[axis], scale, 2097151);
+    }
+    return (morton_expand_bits_21(q[0]) << 2) | (morton_expand_bits_21(q[1]) << 1) | morton_expand_bits_21(q[2]);
+}
+
+#endif //BVH_MORTON_H
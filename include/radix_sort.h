@@ -0,0 +1,72 @@
+//
+// Created by mykola on 22.05.24.
+//
+
+#ifndef BVH_RADIX_SORT_H
+#define BVH_RADIX_SORT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Stable LSD radix sort of (key, value) pairs by the low key_bits bits of the key, 8 bits per pass.
+// Every pass builds one histogram per chunk, a digit-major prefix sum over all of them and then
+// scatters each chunk independently, so the result does not depend on the number of threads.
+inline void radix_sort_pairs(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, unsigned key_bits,
+                             thread_pool* pool = nullptr) {
+    const size_t radix = 256;
+    const size_t min_chunk = 8192;
+    size_t count = keys.size();
+
+    size_t chunk_count = 1;
+    if (pool != nullptr) {
+        chunk_count = std::max<size_t>(1, std::min(pool->size() * 2, count / min_chunk));
+    }
+    size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+    std::vector<uint64_t> keys_tmp(count);
+    std::vector<uint32_t> values_tmp(count);
+    std::vector<size_t> offsets(chunk_count * radix);
+
+    for (unsigned shift = 0; shift < key_bits; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        parallel_for(chunk_count > 1 ? pool : nullptr, 0, chunk_count, 1, [&](size_t first, size_t last) {
+            for (size_t chunk = first; chunk < last; chunk++) {
+                size_t* histogram = &offsets[chunk * radix];
+                size_t end = std::min(count, (chunk + 1) * chunk_size);
+                for (size_t i = chunk * chunk_size; i < end; i++) {
+                    histogram[(keys[i] >> shift) & 0xff]++;
+                }
+            }
+        });
+
+        size_t sum = 0;
+        for (size_t digit = 0; digit < radix; digit++) {
+            for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+                size_t n = offsets[chunk * radix + digit];
+                offsets[chunk * radix + digit] = sum;
+                sum += n;
+            }
+        }
+
+        parallel_for(chunk_count > 1 ? pool : nullptr, 0, chunk_count, 1, [&](size_t first, size_t last) {
+            for (size_t chunk = first; chunk < last; chunk++) {
+                size_t* offset = &offsets[chunk * radix];
+                size_t end = std::min(count, (chunk + 1) * chunk_size);
+                for (size_t i = chunk * chunk_size; i < end; i++) {
+                    size_t dst = offset[(keys[i] >> shift) & 0xff]++;
+                    keys_tmp[dst] = keys[i];
+                    values_tmp[dst] = values[i];
+                }
+            }
+        });
+
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+#endif //BVH_RADIX_SORT_H
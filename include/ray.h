@@ -0,0 +1,167 @@
+//
+// Created by mykola on 25.05.24.
+//
+
+#ifndef BVH_RAY_H
+#define BVH_RAY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "vector3.h"
+
+struct ray {
+    vector3 origin;
+    vector3 direction;
+    float tmin;
+    float tmax;
+
+    ray(const vector3& origin, const vector3& direction,
+        float tmin = 0.0f, float tmax = std::numeric_limits<float>::infinity())
+            : origin(origin), direction(direction), tmin(tmin), tmax(tmax) {}
+
+    vector3 at(float t) const {
+        return origin + direction * t;
+    }
+
+    // 1 / direction, zero components become infinities of the matching sign
+    vector3 inv_direction() const {
+        return vector3{1.0f / direction.data[0], 1.0f / direction.data[1], 1.0f / direction.data[2]};
+    }
+};
+
+struct hit_record {
+    float t = std::numeric_limits<float>::infinity();
+    float u = 0.0f;
+    float v = 0.0f;
+    uint32_t triangle = std::numeric_limits<uint32_t>::max();   // index into scene::get_triangles()
+    uint32_t instance = std::numeric_limits<uint32_t>::max();   // index of the instance in an instance_bvh
+
+    bool hit() const {
+        return triangle != std::numeric_limits<uint32_t>::max();
+    }
+};
+
+// Moller-Trumbore, same test as FindHit in path_tracer.cs. Accepts hits in (r.tmin, tmax).
+inline bool intersect_triangle(const ray& r, const vector3& v0, const vector3& v1, const vector3& v2,
+                               float tmax, float& t, float& u, float& v) {
+    const float epsilon = 1e-8f;
+    vector3 edge1 = v1 - v0;
+    vector3 edge2 = v2 - v0;
+    vector3 h = r.direction.cross(edge2);
+    float a = edge1.dot(h);
+    if (a > -epsilon && a < epsilon) {
+        return false;
+    }
+
+    float f = 1.0f / a;
+    vector3 s = r.origin - v0;
+    u = s.dot(h) * f;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+
+    vector3 q = s.cross(edge1);
+    v = r.direction.dot(q) * f;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+
+    t = edge2.dot(q) * f;
+    return t > r.tmin && t < tmax;
+}
+
+// Triangle test used by blocked_bvh and cpu_path_tracer
+enum class triangle_test {
+    moller_trumbore,    // intersect_triangle(), the test of FindHit
+    watertight          // intersect_triangle_watertight()
+};
+
+// Ray prepared for the watertight test (Woop, Benthin and Wald 2013). kz is the axis of the largest
+// direction component, kx and ky the other two in an order that keeps the winding, and the shear
+// sx, sy, sz maps the direction onto +z. Computed once and reused for every triangle of a traversal.
+struct watertight_ray {
+    vector3 origin;
+    float tmin;
+    float tmax;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    explicit watertight_ray(const ray& r): origin(r.origin), tmin(r.tmin), tmax(r.tmax) {
+        const vector3& d = r.direction;
+        kz = 0;
+        for (int axis = 1; axis < 3; axis++) {
+            if (std::fabs(d.data[axis]) > std::fabs(d.data[kz])) {
+                kz = axis;
+            }
+        }
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d.data[kz] < 0.0f) {
+            std::swap(kx, ky);
+        }
+        sx = d.data[kx] / d.data[kz];
+        sy = d.data[ky] / d.data[kz];
+        sz = 1.0f / d.data[kz];
+    }
+};
+
+// Edge functions of a triangle already translated to the ray origin and sheared, recomputed in
+// double when one is exactly 0 so an edge or vertex hit is decided the same way for every triangle sharing it
+inline void watertight_edge_functions(float ax, float ay, float bx, float by, float cx, float cy,
+                                      float& u, float& v, float& w) {
+    u = cx * by - cy * bx;
+    v = ax * cy - ay * cx;
+    w = bx * ay - by * ax;
+    if (u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+        v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+        w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+    }
+}
+
+// Watertight ray-triangle test: no epsilon, a ray through a shared edge or vertex hits at least one
+// of the triangles. Accepts hits in (r.tmin, tmax), u and v weight v1 and v2 like intersect_triangle().
+inline bool intersect_triangle_watertight(const watertight_ray& r, const vector3& v0, const vector3& v1, const vector3& v2,
+                                          float tmax, float& t, float& u, float& v) {
+    vector3 a = v0 - r.origin;
+    vector3 b = v1 - r.origin;
+    vector3 c = v2 - r.origin;
+    float ax = a.data[r.kx] - r.sx * a.data[r.kz];
+    float ay = a.data[r.ky] - r.sy * a.data[r.kz];
+    float bx = b.data[r.kx] - r.sx * b.data[r.kz];
+    float by = b.data[r.ky] - r.sy * b.data[r.kz];
+    float cx = c.data[r.kx] - r.sx * c.data[r.kz];
+    float cy = c.data[r.ky] - r.sy * c.data[r.kz];
+
+    float eu, ev, ew;
+    watertight_edge_functions(ax, ay, bx, by, cx, cy, eu, ev, ew);
+    bool negative = eu < 0.0f || ev < 0.0f || ew < 0.0f;
+    bool positive = eu > 0.0f || ev > 0.0f || ew > 0.0f;
+    if (negative && positive) {
+        return false;
+    }
+
+    float det = eu + ev + ew;
+    float scaled_t = eu * (r.sz * a.data[r.kz]) + ev * (r.sz * b.data[r.kz]) + ew * (r.sz * c.data[r.kz]);
+    if (det < 0.0f) {
+        det = -det;
+        scaled_t = -scaled_t;
+        ev = -ev;
+        ew = -ew;
+    }
+    // t = scaled_t / det, compared without the division
+    if (!(det > 0.0f && scaled_t > r.tmin * det && scaled_t < tmax * det)) {
+        return false;
+    }
+
+    float inv_det = 1.0f / det;
+    t = scaled_t * inv_det;
+    u = ev * inv_det;
+    v = ew * inv_det;
+    return true;
+}
+
+#endif //BVH_RAY_H
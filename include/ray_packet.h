@@ -0,0 +1,122 @@
+//
+// Created by mykola on 07.06.24.
+//
+
+#ifndef BVH_RAY_PACKET_H
+#define BVH_RAY_PACKET_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "aabb.h"
+#include "ray.h"
+
+// Up to Size rays traced together, usually the camera rays of a small block of pixels.
+// Rays are stored as structure of arrays, hits[i] receives the closest hit of ray i.
+template <int Size>
+struct ray_packet {
+    static_assert(Size == 8 || Size == 16, "ray_packet holds 8 or 16 rays");
+
+    float origin[3][Size];
+    float direction[3][Size];
+    float inv_direction[3][Size];
+    float tmin[Size];
+    float tmax[Size];
+    hit_record hits[Size];
+    int size = 0;
+
+    void clear() {
+        size = 0;
+    }
+
+    void add(const ray& r) {
+        vector3 inv = r.inv_direction();
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis][size] = r.origin.data[axis];
+            direction[axis][size] = r.direction.data[axis];
+            inv_direction[axis][size] = inv.data[axis];
+        }
+        tmin[size] = r.tmin;
+        tmax[size] = r.tmax;
+        hits[size] = hit_record();
+        size++;
+    }
+
+    ray get(int i) const {
+        return ray(vector3{origin[0][i], origin[1][i], origin[2][i]},
+                   vector3{direction[0][i], direction[1][i], direction[2][i]}, tmin[i], tmax[i]);
+    }
+
+    // Slab test of ray i clipped to its closest hit so far
+    bool intersect_box(int i, const aabb& box, float& t_near) const {
+        return box.intersect(vector3{origin[0][i], origin[1][i], origin[2][i]},
+                             vector3{inv_direction[0][i], inv_direction[1][i], inv_direction[2][i]},
+                             tmin[i], std::min(tmax[i], hits[i].t), t_near);
+    }
+};
+
+// Interval arithmetic bounds of a packet (Boulos et al. 2006): the ranges of origins and inverse
+// directions per axis. When every direction has the same sign on each axis, a box test with the
+// ranges gives a lower bound on the entry and an upper bound on the exit distance of all rays,
+// so one test can cull a node for the whole packet.
+struct ray_packet_bounds {
+    float origin_min[3];
+    float origin_max[3];
+    float inv_min[3];
+    float inv_max[3];
+    bool negative[3];
+    float tmin;
+
+    // False when some axis has directions of both signs (or zero), the interval test is useless then
+    template <int Size>
+    bool compute(const ray_packet<Size>& packet) {
+        tmin = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < packet.size; i++) {
+            tmin = std::min(tmin, packet.tmin[i]);
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            const float* o = packet.origin[axis];
+            const float* inv = packet.inv_direction[axis];
+            origin_min[axis] = *std::min_element(o, o + packet.size);
+            origin_max[axis] = *std::max_element(o, o + packet.size);
+            inv_min[axis] = *std::min_element(inv, inv + packet.size);
+            inv_max[axis] = *std::max_element(inv, inv + packet.size);
+            negative[axis] = inv_max[axis] < 0.0f;
+            bool positive = inv_min[axis] > 0.0f;
+            if (!negative[axis] && !positive) {
+                return false;
+            }
+            if (std::isinf(inv_min[axis]) || std::isinf(inv_max[axis])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // False only if no ray of the packet can hit box before tmax
+    bool may_hit(const aabb& box, float tmax) const {
+        float t_lower = tmin;
+        float t_upper = tmax;
+        for (int axis = 0; axis < 3; axis++) {
+            float near_plane = negative[axis] ? box.max_corner.data[axis] : box.min_corner.data[axis];
+            float far_plane = negative[axis] ? box.min_corner.data[axis] : box.max_corner.data[axis];
+            t_lower = std::max(t_lower, product_min(near_plane - origin_max[axis], near_plane - origin_min[axis],
+                                                    inv_min[axis], inv_max[axis]));
+            t_upper = std::min(t_upper, product_max(far_plane - origin_max[axis], far_plane - origin_min[axis],
+                                                    inv_min[axis], inv_max[axis]));
+        }
+        return t_lower <= t_upper;
+    }
+
+private:
+    static float product_min(float a0, float a1, float b0, float b1) {
+        return std::min(std::min(a0 * b0, a0 * b1), std::min(a1 * b0, a1 * b1));
+    }
+
+    static float product_max(float a0, float a1, float b0, float b1) {
+        return std::max(std::max(a0 * b0, a0 * b1), std::max(a1 * b0, a1 * b1));
+    }
+};
+
+#endif //BVH_RAY_PACKET_H
@@ -0,0 +1,203 @@
+//
+// Created by mykola on 09.06.24.
+//
+
+#ifndef BVH_SAMPLER_H
+#define BVH_SAMPLER_H
+
+#include <cstdint>
+
+// Hash and xorshift generator of path_tracer.cs, bit for bit
+struct shader_rng {
+    uint32_t state = 0;
+
+    shader_rng() = default;
+    explicit shader_rng(uint32_t key): state(hash(key)) {}
+
+    void seed(uint32_t key) {
+        state = hash(key);
+    }
+
+    static uint32_t hash(uint32_t key) {
+        key = (key ^ 61u) ^ (key >> 16u);
+        key = key + (key << 3u);
+        key = key ^ (key >> 4u);
+        key = key * 0x27D4EB2Du;
+        key = key ^ (key >> 15u);
+        return key;
+    }
+
+    uint32_t next_uint() {
+        state ^= (state << 13u);
+        state ^= (state >> 17u);
+        state ^= (state << 5u);
+        return state;
+    }
+
+    // state * 2^-32
+    float next_float() {
+        return static_cast<float>(next_uint()) * 2.3283064365386963e-10f;
+    }
+};
+
+// Direction numbers of the first four Sobol dimensions (Joe and Kuo), 32 bits each. The shader
+// reads the same table from an SSBO (sobol_buffer), directions[d][b] is element d * 32 + b.
+struct sobol_table {
+    static const int dimensions = 4;
+    static const int bits = 32;
+
+    uint32_t directions[dimensions][bits];
+
+    // XOR of the directions selected by every value of each index byte: the scrambled indices have
+    // about 16 random bits set, so the bit by bit loop of the shader mispredicts most of its branches
+    uint32_t byte_directions[dimensions][4][256];
+
+    static const sobol_table& get() {
+        static const sobol_table table;
+        return table;
+    }
+
+    // Component dimension of Sobol point index, as a 32-bit fixed point fraction
+    uint32_t sample(uint32_t index, uint32_t dimension) const {
+        const uint32_t (&bytes)[4][256] = byte_directions[dimension];
+        return bytes[0][index & 0xFFu] ^ bytes[1][(index >> 8) & 0xFFu] ^ bytes[2][(index >> 16) & 0xFFu] ^
+               bytes[3][index >> 24];
+    }
+
+private:
+    sobol_table() {
+        // Degree, coefficients and initial values of the primitive polynomials of dimensions 1 to 3,
+        // dimension 0 is the van der Corput sequence
+        const int degree[dimensions] = {0, 1, 2, 3};
+        const uint32_t coefficients[dimensions] = {0, 0, 1, 1};
+        const uint32_t initial[dimensions][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+        for (int b = 0; b < bits; b++) {
+            directions[0][b] = 1u << (31 - b);
+        }
+        for (int d = 1; d < dimensions; d++) {
+            int s = degree[d];
+            for (int b = 0; b < bits; b++) {
+                if (b < s) {
+                    directions[d][b] = initial[d][b] << (31 - b);
+                    continue;
+                }
+                uint32_t v = directions[d][b - s] ^ (directions[d][b - s] >> s);
+                for (int i = 1; i < s; i++) {
+                    if ((coefficients[d] >> (s - 1 - i)) & 1u) {
+                        v ^= directions[d][b - i];
+                    }
+                }
+                directions[d][b] = v;
+            }
+        }
+
+        for (int d = 0; d < dimensions; d++) {
+            for (int byte = 0; byte < 4; byte++) {
+                for (uint32_t value = 0; value < 256; value++) {
+                    uint32_t x = 0;
+                    for (int bit = 0; bit < 8; bit++) {
+                        if ((value >> bit) & 1u) {
+                            x ^= directions[d][byte * 8 + bit];
+                        }
+                    }
+                    byte_directions[d][byte][value] = x;
+                }
+            }
+        }
+    }
+};
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash-based Owen scrambling (Burley 2020): the Laine-Karras permutation on the reversed bits
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return reverse_bits(x);
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t value) {
+    return seed ^ (shader_rng::hash(value) + 0x9E3779B9u + (seed << 6) + (seed >> 2));
+}
+
+// Component of an Owen-scrambled Sobol point whose index was already shuffled with group_seed
+inline float owen_sobol_component(uint32_t group_seed, uint32_t shuffled_index, uint32_t component) {
+    uint32_t x = nested_uniform_scramble(sobol_table::get().sample(shuffled_index, component), hash_combine(group_seed, component));
+    return static_cast<float>(x >> 8) * 5.9604644775390625e-8f;     // 2^-24, stays below 1
+}
+
+// Owen-scrambled, shuffled Sobol sample (Burley 2020) in [0, 1). Dimensions come in groups of four;
+// every group is its own 4D Sobol sequence, shuffled and scrambled with a seed of its own, so any
+// number of dimensions can be drawn from the four tabulated ones. pixel_seed decorrelates the pixels.
+inline float owen_sobol(uint32_t pixel_seed, uint32_t index, uint32_t dimension) {
+    uint32_t seed = hash_combine(pixel_seed, dimension / sobol_table::dimensions);
+    return owen_sobol_component(seed, nested_uniform_scramble(index, seed), dimension % sobol_table::dimensions);
+}
+
+enum class sampler_type {
+    random,     // shader_rng white noise, as path_tracer.cs with sobol = false
+    sobol       // owen_sobol()
+};
+
+// Random numbers of one path sample. With sampler_type::sobol, dimensions 0 and 1 jitter the
+// camera ray and every bounce takes the next dimensions_per_bounce: one group for the scattering
+// decisions and one for the light sample, so a dimension means the same thing in every sample of the pixel.
+class path_sampler {
+    shader_rng m_rng;
+    sampler_type m_type = sampler_type::random;
+    uint32_t m_pixel_seed = 0;
+    uint32_t m_index = 0;
+    uint32_t m_dimension = 0;
+
+    // Seed and shuffled sample index of the current group of dimensions
+    uint32_t m_group = ~0u;
+    uint32_t m_group_seed = 0;
+    uint32_t m_shuffled_index = 0;
+
+public:
+    static const uint32_t dimensions_per_bounce = 2 * sobol_table::dimensions;
+
+    // key seeds the white noise, pixel and sample_index pick the Sobol points
+    void start(sampler_type type, uint32_t key, uint32_t pixel, uint32_t sample_index) {
+        m_type = type;
+        m_rng.seed(key);
+        m_pixel_seed = shader_rng::hash(pixel);
+        m_index = sample_index;
+        m_dimension = 0;
+        m_group = ~0u;
+    }
+
+    void start_bounce(uint32_t depth) {
+        m_dimension = sobol_table::dimensions + dimensions_per_bounce * depth;
+    }
+
+    void start_light_sample(uint32_t depth) {
+        m_dimension = 2 * sobol_table::dimensions + dimensions_per_bounce * depth;
+    }
+
+    float next_float() {
+        if (m_type == sampler_type::random) {
+            return m_rng.next_float();
+        }
+        uint32_t group = m_dimension / sobol_table::dimensions;
+        if (group != m_group) {
+            m_group = group;
+            m_group_seed = hash_combine(m_pixel_seed, group);
+            m_shuffled_index = nested_uniform_scramble(m_index, m_group_seed);
+        }
+        return owen_sobol_component(m_group_seed, m_shuffled_index, m_dimension++ % sobol_table::dimensions);
+    }
+};
+
+#endif //BVH_SAMPLER_H
@@ -9,7 +9,8 @@
 #include <vector>
 #include <limits>
 
-//#include "bvh.h"
+#include "bvh.h"
+#include "light_table.h"
 #include "triangle.h"
 #include "tiny_obj_loader.h"
 
@@ -58,9 +59,19 @@ public:
         return indices;
     }
 
-//    bvh get_bvh() {
-//        return bvh(triangles);
-//    }
+    bvh get_bvh() const {
+        return bvh(triangles, m_vertices);
+    }
+
+    // Alias table of the emissive triangles for next-event estimation, emissions has one entry per triangle
+    light_table get_light_table(const std::vector<vector3>& emissions) const {
+        std::vector<vector3> vertices;
+        vertices.reserve(m_vertices.size());
+        for (const auto& v : m_vertices) {
+            vertices.emplace_back(v.x, v.y, v.z);
+        }
+        return light_table(triangles, vertices, emissions);
+    }
 
     const std::vector<triangle>& get_triangles() const {
         return triangles;
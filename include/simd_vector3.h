@@ -0,0 +1,200 @@
+//
+// Created by mykola on 08.06.24.
+//
+
+#ifndef BVH_SIMD_VECTOR3_H
+#define BVH_SIMD_VECTOR3_H
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "aabb.h"
+#include "cpu_features.h"
+#include "vector3.h"
+
+// vector3 in one SSE register. The fourth lane is padding: it is kept at 0 by the constructors
+// and ignored by dot(), max_component() and the conversions. Without SSE it falls back to scalar code.
+struct alignas(16) simd_vector3 {
+#if defined(BVH_X86)
+    union {
+        __m128 m;
+        float data[4];
+    };
+
+    explicit simd_vector3(__m128 m): m(m) {}
+    simd_vector3(): m(_mm_setzero_ps()) {}
+    simd_vector3(float x, float y, float z): m(_mm_set_ps(0.0f, z, y, x)) {}
+#else
+    float data[4];
+
+    simd_vector3(): data{0, 0, 0, 0} {}
+    simd_vector3(float x, float y, float z): data{x, y, z, 0} {}
+#endif
+
+    explicit simd_vector3(const vector3& v): simd_vector3(v.data[0], v.data[1], v.data[2]) {}
+
+    vector3 to_vector3() const {
+        return vector3{data[0], data[1], data[2]};
+    }
+
+#if defined(BVH_X86)
+    simd_vector3 operator+(const simd_vector3& other) const {
+        return simd_vector3(_mm_add_ps(m, other.m));
+    }
+
+    simd_vector3 operator-(const simd_vector3& other) const {
+        return simd_vector3(_mm_sub_ps(m, other.m));
+    }
+
+    simd_vector3 operator*(float scalar) const {
+        return simd_vector3(_mm_mul_ps(m, _mm_set1_ps(scalar)));
+    }
+
+    simd_vector3 operator*(const simd_vector3& other) const {
+        return simd_vector3(_mm_mul_ps(m, other.m));
+    }
+
+    simd_vector3 operator/(float scalar) const {
+        return simd_vector3(_mm_div_ps(m, _mm_set1_ps(scalar)));
+    }
+
+    simd_vector3 operator-() const {
+        return simd_vector3(_mm_sub_ps(_mm_setzero_ps(), m));
+    }
+
+    // Component-wise min / max with the operand order of std::min(a, b) / std::max(a, b),
+    // so ties and signed zeros resolve the same way as the scalar aabb code
+    static simd_vector3 min(const simd_vector3& a, const simd_vector3& b) {
+        return simd_vector3(_mm_min_ps(b.m, a.m));
+    }
+
+    static simd_vector3 max(const simd_vector3& a, const simd_vector3& b) {
+        return simd_vector3(_mm_max_ps(b.m, a.m));
+    }
+
+    // 1 / v from _mm_rcp_ps refined by one Newton-Raphson step, within a few ulp of the division.
+    // Zero lanes give infinities of the matching sign like the division does.
+    simd_vector3 reciprocal() const {
+        __m128 r = _mm_rcp_ps(m);
+        __m128 refined = _mm_sub_ps(_mm_add_ps(r, r), _mm_mul_ps(_mm_mul_ps(r, r), m));
+        __m128 is_inf = _mm_cmpeq_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), r), _mm_set1_ps(std::numeric_limits<float>::infinity()));
+        return simd_vector3(_mm_or_ps(_mm_and_ps(is_inf, r), _mm_andnot_ps(is_inf, refined)));
+    }
+#else
+    simd_vector3 operator+(const simd_vector3& o) const {
+        return simd_vector3{data[0] + o.data[0], data[1] + o.data[1], data[2] + o.data[2]};
+    }
+
+    simd_vector3 operator-(const simd_vector3& o) const {
+        return simd_vector3{data[0] - o.data[0], data[1] - o.data[1], data[2] - o.data[2]};
+    }
+
+    simd_vector3 operator*(float s) const {
+        return simd_vector3{data[0] * s, data[1] * s, data[2] * s};
+    }
+
+    simd_vector3 operator*(const simd_vector3& o) const {
+        return simd_vector3{data[0] * o.data[0], data[1] * o.data[1], data[2] * o.data[2]};
+    }
+
+    simd_vector3 operator/(float s) const {
+        return simd_vector3{data[0] / s, data[1] / s, data[2] / s};
+    }
+
+    simd_vector3 operator-() const {
+        return simd_vector3{-data[0], -data[1], -data[2]};
+    }
+
+    static simd_vector3 min(const simd_vector3& a, const simd_vector3& b) {
+        return simd_vector3{std::min(a.data[0], b.data[0]), std::min(a.data[1], b.data[1]), std::min(a.data[2], b.data[2])};
+    }
+
+    static simd_vector3 max(const simd_vector3& a, const simd_vector3& b) {
+        return simd_vector3{std::max(a.data[0], b.data[0]), std::max(a.data[1], b.data[1]), std::max(a.data[2], b.data[2])};
+    }
+
+    simd_vector3 reciprocal() const {
+        return simd_vector3{1.0f / data[0], 1.0f / data[1], 1.0f / data[2]};
+    }
+#endif
+
+    simd_vector3& operator+=(const simd_vector3& other) {
+        *this = *this + other;
+        return *this;
+    }
+
+    float dot(const simd_vector3& other) const {
+        simd_vector3 p = *this * other;
+        return p.data[0] + p.data[1] + p.data[2];
+    }
+
+    simd_vector3 cross(const simd_vector3& other) const {
+        return simd_vector3{
+            data[1] * other.data[2] - data[2] * other.data[1],
+            data[2] * other.data[0] - data[0] * other.data[2],
+            data[0] * other.data[1] - data[1] * other.data[0]
+        };
+    }
+
+    simd_vector3 normalize() const {
+        return *this / std::sqrt(dot(*this));
+    }
+
+    float max_component() const {
+        return std::fmax(data[0], std::fmax(data[1], data[2]));
+    }
+};
+
+// aabb with SSE corners, for the reductions of the builder: merging two boxes is one min and one max
+struct alignas(16) simd_aabb {
+    simd_vector3 min_corner;
+    simd_vector3 max_corner;
+
+    simd_aabb() = default;
+    simd_aabb(const simd_vector3& min_corner, const simd_vector3& max_corner): min_corner(min_corner), max_corner(max_corner) {}
+    explicit simd_aabb(const aabb& box): min_corner(box.min_corner), max_corner(box.max_corner) {}
+
+    static simd_aabb empty() {
+        float inf = std::numeric_limits<float>::infinity();
+        return simd_aabb{simd_vector3{inf, inf, inf}, simd_vector3{-inf, -inf, -inf}};
+    }
+
+    aabb to_aabb() const {
+        return aabb{min_corner.to_vector3(), max_corner.to_vector3()};
+    }
+
+    // Same as aabb::centroid(), lane by lane
+    simd_vector3 centroid() const {
+        return min_corner * 0.5f + max_corner * 0.5f;
+    }
+
+    float surface_area() const {
+        return to_aabb().surface_area();
+    }
+
+    void expand(const simd_vector3& point) {
+        min_corner = simd_vector3::min(min_corner, point);
+        max_corner = simd_vector3::max(max_corner, point);
+    }
+
+    void merge(const simd_aabb& other) {
+        min_corner = simd_vector3::min(min_corner, other.min_corner);
+        max_corner = simd_vector3::max(max_corner, other.max_corner);
+    }
+
+    static simd_aabb surrounding_box(const simd_aabb& box0, const simd_aabb& box1) {
+        simd_aabb box = box0;
+        box.merge(box1);
+        return box;
+    }
+
+    static simd_aabb from_triangle(const triangle& tri, const std::vector<vector3>& vertices) {
+        simd_vector3 v0(vertices[tri.vertices_ids[0]]);
+        simd_vector3 v1(vertices[tri.vertices_ids[1]]);
+        simd_vector3 v2(vertices[tri.vertices_ids[2]]);
+        return simd_aabb{simd_vector3::min(v0, simd_vector3::min(v1, v2)), simd_vector3::max(v0, simd_vector3::max(v1, v2))};
+    }
+};
+
+#endif //BVH_SIMD_VECTOR3_H
@@ -0,0 +1,244 @@
+//
+// Created by mykola on 20.05.24.
+//
+
+#ifndef BVH_THREAD_POOL_H
+#define BVH_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool. Every worker owns a deque: it pushes and pops its own tasks at the back
+// and steals from the front of the others, so forked subtrees stay hot in the cache of the
+// thread that spawned them while idle threads take the biggest (oldest) pieces of work.
+class thread_pool {
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_queued{0};
+    std::atomic<size_t> m_next_queue{0};
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_sleep_cv;
+    bool m_stop = false;
+
+    static thread_pool*& current_pool() {
+        static thread_local thread_pool* pool = nullptr;
+        return pool;
+    }
+
+    static size_t& current_index() {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+public:
+    explicit thread_pool(size_t thread_count = std::thread::hardware_concurrency()) {
+        thread_count = std::max<size_t>(thread_count, 1);
+        for (size_t i = 0; i < thread_count; i++) {
+            m_queues.emplace_back(new worker_queue);
+        }
+        for (size_t i = 0; i < thread_count; i++) {
+            m_threads.emplace_back([this, i]() { worker_loop(i); });
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_stop = true;
+        }
+        m_sleep_cv.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    size_t size() const {
+        return m_threads.size();
+    }
+
+    // Index of the calling worker, or size() when called from a thread outside the pool
+    size_t worker_index() const {
+        return current_pool() == this ? current_index() : size();
+    }
+
+    // Pushes to the calling worker's own deque, external threads spread tasks round robin
+    void submit(std::function<void()> task) {
+        size_t worker = worker_index();
+        if (worker == size()) {
+            worker = m_next_queue.fetch_add(1, std::memory_order_relaxed) % size();
+        }
+        submit_to(worker, std::move(task));
+    }
+
+    void submit_to(size_t worker, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_queues[worker % size()]->mutex);
+            m_queues[worker % size()]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_queued.fetch_add(1);
+        }
+        m_sleep_cv.notify_one();
+    }
+
+    // Runs one queued task on the calling thread, used by waiters so nested fork/join cannot deadlock
+    bool run_pending_task() {
+        std::function<void()> task;
+        if (!take_task(worker_index(), task)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+private:
+    bool take_task(size_t worker, std::function<void()>& task) {
+        if (worker < size()) {
+            worker_queue& own = *m_queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                m_queued.fetch_sub(1);
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i <= size(); i++) {
+            worker_queue& victim = *m_queues[(worker + i) % size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                m_queued.fetch_sub(1);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void worker_loop(size_t index) {
+        current_pool() = this;
+        current_index() = index;
+
+        while (true) {
+            std::function<void()> task;
+            if (take_task(index, task)) {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_sleep_cv.wait(lock, [this]() { return m_stop || m_queued.load() > 0; });
+            if (m_stop && m_queued.load() == 0) {
+                return;
+            }
+        }
+    }
+};
+
+// Fork/join scope: run() forks a task, wait() helps executing pool tasks until all forked ones finished
+// and rethrows the first exception thrown by any of them.
+class task_group {
+    thread_pool& m_pool;
+    std::atomic<size_t> m_pending{0};
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+
+public:
+    explicit task_group(thread_pool& pool): m_pool(pool) {}
+
+    task_group(const task_group&) = delete;
+    task_group& operator=(const task_group&) = delete;
+
+    ~task_group() {
+        while (m_pending.load() > 0) {
+            if (!m_pool.run_pending_task()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void run(std::function<void()> task) {
+        m_pending.fetch_add(1);
+        m_pool.submit(wrap(std::move(task)));
+    }
+
+    // Forks onto the deque of a given worker, other workers may still steal it
+    void run_on(size_t worker, std::function<void()> task) {
+        m_pending.fetch_add(1);
+        m_pool.submit_to(worker, wrap(std::move(task)));
+    }
+
+    void wait() {
+        while (m_pending.load() > 0) {
+            if (!m_pool.run_pending_task()) {
+                std::this_thread::yield();
+            }
+        }
+        if (m_error) {
+            std::exception_ptr error = m_error;
+            m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    std::function<void()> wrap(std::function<void()> task) {
+        return [this, task]() {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_error_mutex);
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+            m_pending.fetch_sub(1);
+        };
+    }
+};
+
+// Calls body(chunk_begin, chunk_end) over [begin, end) split into chunks of at least grain items.
+// The caller takes part in the work; with a null pool everything runs inline.
+template <typename Body>
+void parallel_for(thread_pool* pool, size_t begin, size_t end, size_t grain, const Body& body) {
+    size_t count = end - begin;
+    if (pool == nullptr || count <= grain) {
+        if (count > 0) {
+            body(begin, end);
+        }
+        return;
+    }
+
+    size_t chunks = std::min((count + grain - 1) / grain, pool->size() * 4);
+    size_t chunk_size = (count + chunks - 1) / chunks;
+
+    task_group group(*pool);
+    for (size_t chunk_begin = begin + chunk_size; chunk_begin < end; chunk_begin += chunk_size) {
+        size_t chunk_end = std::min(chunk_begin + chunk_size, end);
+        group.run([&body, chunk_begin, chunk_end]() { body(chunk_begin, chunk_end); });
+    }
+    body(begin, std::min(begin + chunk_size, end));
+    group.wait();
+}
+
+#endif //BVH_THREAD_POOL_H
@@ -0,0 +1,117 @@
+//
+// Created by mykola on 05.06.24.
+//
+
+#ifndef BVH_TILE_SCHEDULER_H
+#define BVH_TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "arena.h"
+#include "morton.h"
+#include "thread_pool.h"
+
+struct render_tile {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Samples traced by one thread. Padded to a cache line so workers never write to a shared line.
+struct alignas(64) render_worker_stats {
+    uint64_t samples = 0;
+    uint64_t tiles = 0;
+    double seconds = 0.0;
+
+    double samples_per_second() const {
+        return seconds > 0.0 ? static_cast<double>(samples) / seconds : 0.0;
+    }
+};
+
+// Cuts a frame into tiles ordered along a Morton curve and renders them on a thread_pool.
+// Every worker gets a contiguous run of the curve on its own deque, so neighbouring tiles
+// (and the geometry they see) stay on one core; when path lengths differ, idle workers steal
+// tiles from the far end of other runs instead of waiting on a static partition.
+class tile_scheduler {
+    int m_tile_size;
+    std::vector<render_tile> m_tiles;
+    std::vector<render_worker_stats, aligned_allocator<render_worker_stats, 64>> m_stats;
+
+public:
+    tile_scheduler(int width, int height, int tile_size = 16)
+            : m_tile_size(tile_size) {
+        int columns = (width + tile_size - 1) / tile_size;
+        int rows = (height + tile_size - 1) / tile_size;
+
+        std::vector<std::pair<uint32_t, render_tile>> keyed;
+        for (int row = 0; row < rows; row++) {
+            for (int column = 0; column < columns; column++) {
+                render_tile tile{column * tile_size, row * tile_size,
+                                 std::min(tile_size, width - column * tile_size),
+                                 std::min(tile_size, height - row * tile_size)};
+                keyed.emplace_back(morton_code_2d(static_cast<uint32_t>(column), static_cast<uint32_t>(row)), tile);
+            }
+        }
+        std::sort(keyed.begin(), keyed.end(), [](const std::pair<uint32_t, render_tile>& a,
+                                                 const std::pair<uint32_t, render_tile>& b) {
+            return a.first < b.first;
+        });
+        for (const auto& k : keyed) {
+            m_tiles.push_back(k.second);
+        }
+    }
+
+    int tile_size() const {
+        return m_tile_size;
+    }
+
+    // Tiles in Morton order
+    const std::vector<render_tile>& tiles() const {
+        return m_tiles;
+    }
+
+    // Calls body(tile, worker) for every tile, where worker is in [0, pool.size()] and the last
+    // index is the calling thread, which helps while it waits. body returns the number of samples
+    // it traced. Stats accumulate over calls until reset_stats().
+    template <typename Body>
+    void run(thread_pool& pool, const Body& body) {
+        size_t workers = pool.size();
+        if (m_stats.size() != workers + 1) {
+            m_stats.assign(workers + 1, render_worker_stats());
+        }
+
+        task_group group(pool);
+        for (size_t w = 0; w < workers; w++) {
+            size_t begin = m_tiles.size() * w / workers;
+            size_t end = m_tiles.size() * (w + 1) / workers;
+            // The owner pops from the back, push its run reversed so it walks the curve forwards
+            for (size_t i = end; i-- > begin;) {
+                group.run_on(w, [this, &pool, &body, i]() {
+                    size_t worker = pool.worker_index();
+                    auto start = std::chrono::steady_clock::now();
+                    uint64_t samples = body(m_tiles[i], worker);
+                    render_worker_stats& stats = m_stats[worker];
+                    stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    stats.samples += samples;
+                    stats.tiles++;
+                });
+            }
+        }
+        group.wait();
+    }
+
+    // Per-thread totals, indexed like the worker argument of run()
+    const std::vector<render_worker_stats, aligned_allocator<render_worker_stats, 64>>& stats() const {
+        return m_stats;
+    }
+
+    void reset_stats() {
+        std::fill(m_stats.begin(), m_stats.end(), render_worker_stats());
+    }
+};
+
+#endif //BVH_TILE_SCHEDULER_H
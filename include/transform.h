@@ -0,0 +1,117 @@
+//
+// Created by mykola on 01.06.24.
+//
+
+#ifndef BVH_TRANSFORM_H
+#define BVH_TRANSFORM_H
+
+#include <cmath>
+#include <stdexcept>
+
+#include "aabb.h"
+#include "vector3.h"
+
+// Affine transform stored as the top 3 rows of a 4x4 matrix: rotation/scale in the first three
+// columns, translation in the last one.
+struct transform3x4 {
+    float m[3][4];
+
+    transform3x4(): m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static transform3x4 translation(const vector3& offset) {
+        transform3x4 result;
+        for (int row = 0; row < 3; row++) {
+            result.m[row][3] = offset.data[row];
+        }
+        return result;
+    }
+
+    // Right-handed rotation by angle radians around the y axis
+    static transform3x4 rotation_y(float angle) {
+        transform3x4 result;
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        result.m[0][0] = c;
+        result.m[0][2] = s;
+        result.m[2][0] = -s;
+        result.m[2][2] = c;
+        return result;
+    }
+
+    static transform3x4 scale(float factor) {
+        transform3x4 result;
+        for (int row = 0; row < 3; row++) {
+            result.m[row][row] = factor;
+        }
+        return result;
+    }
+
+    // this * other, other is applied first
+    transform3x4 operator*(const transform3x4& other) const {
+        transform3x4 result;
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 4; column++) {
+                float value = column == 3 ? m[row][3] : 0.0f;
+                for (int k = 0; k < 3; k++) {
+                    value += m[row][k] * other.m[k][column];
+                }
+                result.m[row][column] = value;
+            }
+        }
+        return result;
+    }
+
+    vector3 apply_point(const vector3& p) const {
+        return vector3{m[0][0] * p.data[0] + m[0][1] * p.data[1] + m[0][2] * p.data[2] + m[0][3],
+                       m[1][0] * p.data[0] + m[1][1] * p.data[1] + m[1][2] * p.data[2] + m[1][3],
+                       m[2][0] * p.data[0] + m[2][1] * p.data[1] + m[2][2] * p.data[2] + m[2][3]};
+    }
+
+    vector3 apply_vector(const vector3& v) const {
+        return vector3{m[0][0] * v.data[0] + m[0][1] * v.data[1] + m[0][2] * v.data[2],
+                       m[1][0] * v.data[0] + m[1][1] * v.data[1] + m[1][2] * v.data[2],
+                       m[2][0] * v.data[0] + m[2][1] * v.data[1] + m[2][2] * v.data[2]};
+    }
+
+    // Box around the 8 transformed corners
+    aabb apply_box(const aabb& box) const {
+        aabb result = aabb::empty();
+        for (int corner = 0; corner < 8; corner++) {
+            vector3 p{(corner & 1) ? box.max_corner.data[0] : box.min_corner.data[0],
+                      (corner & 2) ? box.max_corner.data[1] : box.min_corner.data[1],
+                      (corner & 4) ? box.max_corner.data[2] : box.min_corner.data[2]};
+            result.expand(apply_point(p));
+        }
+        return result;
+    }
+
+    transform3x4 inverse() const {
+        float a = m[0][0], b = m[0][1], c = m[0][2];
+        float d = m[1][0], e = m[1][1], f = m[1][2];
+        float g = m[2][0], h = m[2][1], i = m[2][2];
+        float determinant = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+        if (determinant == 0.0f) {
+            throw std::invalid_argument("Transform is not invertible");
+        }
+
+        float s = 1.0f / determinant;
+        transform3x4 result;
+        result.m[0][0] = (e * i - f * h) * s;
+        result.m[0][1] = (c * h - b * i) * s;
+        result.m[0][2] = (b * f - c * e) * s;
+        result.m[1][0] = (f * g - d * i) * s;
+        result.m[1][1] = (a * i - c * g) * s;
+        result.m[1][2] = (c * d - a * f) * s;
+        result.m[2][0] = (d * h - e * g) * s;
+        result.m[2][1] = (b * g - a * h) * s;
+        result.m[2][2] = (a * e - b * d) * s;
+
+        vector3 translation = result.apply_vector(vector3{m[0][3], m[1][3], m[2][3]});
+        for (int row = 0; row < 3; row++) {
+            result.m[row][3] = -translation.data[row];
+        }
+        return result;
+    }
+};
+
+#endif //BVH_TRANSFORM_H
@@ -26,6 +26,10 @@ struct triangle {
     uint32_t vertices_ids[3];
 
 public:
+    triangle(): vertices_ids{0, 0, 0} {}
+
+    triangle(uint32_t v0, uint32_t v1, uint32_t v2): vertices_ids{v0, v1, v2} {}
+
     triangle(const tinyobj::shape_t& shape, const tinyobj::attrib_t& attrib, size_t index) {
         for (size_t i = 0; i < 3; i++) {
             vertices_ids[i] = shape.mesh.indices[index + i].vertex_index;
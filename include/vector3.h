@@ -27,6 +27,34 @@ public:
         return vector3{data[0] * scalar, data[1] * scalar, data[2] * scalar};
     }
 
+    // Component-wise product, for colors
+    vector3 operator*(const vector3& other) const {
+        return vector3{data[0] * other.data[0], data[1] * other.data[1], data[2] * other.data[2]};
+    }
+
+    vector3 operator/(float scalar) const {
+        return vector3{data[0] / scalar, data[1] / scalar, data[2] / scalar};
+    }
+
+    vector3& operator+=(const vector3& other) {
+        data[0] += other.data[0];
+        data[1] += other.data[1];
+        data[2] += other.data[2];
+        return *this;
+    }
+
+    float max_component() const {
+        return std::fmax(data[0], std::fmax(data[1], data[2]));
+    }
+
+    vector3 operator-() const {
+        return vector3{-data[0], -data[1], -data[2]};
+    }
+
+    float dot(const vector3& other) const {
+        return data[0] * other.data[0] + data[1] * other.data[1] + data[2] * other.data[2];
+    }
+
     vector3 cross(const vector3& other) const {
         return vector3{
             data[1] * other.data[2] - data[2] * other.data[1],
@@ -0,0 +1,311 @@
+//
+// Created by mykola on 26.05.24.
+//
+
+#ifndef BVH_WIDE_BVH_H
+#define BVH_WIDE_BVH_H
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "bvh.h"
+#include "cpu_features.h"
+
+// Node of a 4- or 8-wide BVH. Child boxes are stored as structure of arrays so a single
+// SSE (Width = 4) or AVX (Width = 8) slab test checks a ray against all of them.
+template <int Width>
+struct alignas(32) wide_bvh_node {
+    float min_x[Width];
+    float min_y[Width];
+    float min_z[Width];
+    float max_x[Width];
+    float max_y[Width];
+    float max_z[Width];
+    uint32_t child[Width];  // interior child: node index, leaf child: first entry in bvh::indices()
+    uint32_t count[Width];  // primitives of a leaf child, 0 for interior children and empty slots
+
+    static const uint32_t empty_slot = std::numeric_limits<uint32_t>::max();
+
+    bool is_leaf(int slot) const {
+        return count[slot] > 0;
+    }
+
+    bool is_empty(int slot) const {
+        return child[slot] == empty_slot;
+    }
+};
+
+namespace wide_bvh_detail {
+
+// Per-ray data for the slab test. Near and far planes are picked by the direction sign, so the
+// inverted boxes of empty slots (min = +inf, max = -inf) always give t_near = +inf and miss.
+struct ray_data {
+    float origin[3];
+    float inv_direction[3];
+    bool negative[3];
+
+    explicit ray_data(const ray& r) {
+        vector3 inv = r.inv_direction();
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis] = r.origin.data[axis];
+            inv_direction[axis] = inv.data[axis];
+            negative[axis] = inv.data[axis] < 0.0f;
+        }
+    }
+};
+
+template <int Width>
+inline void slab_planes(const wide_bvh_node<Width>& node, const ray_data& r, const float* near[3], const float* far[3]) {
+    const float* mins[3] = {node.min_x, node.min_y, node.min_z};
+    const float* maxs[3] = {node.max_x, node.max_y, node.max_z};
+    for (int axis = 0; axis < 3; axis++) {
+        near[axis] = r.negative[axis] ? maxs[axis] : mins[axis];
+        far[axis] = r.negative[axis] ? mins[axis] : maxs[axis];
+    }
+}
+
+// Tests lanes [offset, offset + 4), returns a 4-bit hit mask and writes the entry distances
+inline unsigned intersect_boxes_4(const float* const near[3], const float* const far[3], int offset,
+                                  const ray_data& r, float tmin, float tmax, float* t_near) {
+#if defined(BVH_X86)
+    __m128 tn = _mm_set1_ps(tmin);
+    __m128 tf = _mm_set1_ps(tmax);
+    for (int axis = 0; axis < 3; axis++) {
+        __m128 origin = _mm_set1_ps(r.origin[axis]);
+        __m128 inv = _mm_set1_ps(r.inv_direction[axis]);
+        tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near[axis] + offset), origin), inv));
+        tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far[axis] + offset), origin), inv));
+    }
+    _mm_storeu_ps(t_near + offset, tn);
+    return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(tn, tf)));
+#else
+    unsigned mask = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        float tn = tmin;
+        float tf = tmax;
+        for (int axis = 0; axis < 3; axis++) {
+            tn = std::max(tn, (near[axis][offset + lane] - r.origin[axis]) * r.inv_direction[axis]);
+            tf = std::min(tf, (far[axis][offset + lane] - r.origin[axis]) * r.inv_direction[axis]);
+        }
+        t_near[offset + lane] = tn;
+        mask |= (tn <= tf ? 1u : 0u) << lane;
+    }
+    return mask;
+#endif
+}
+
+#if defined(BVH_X86)
+BVH_TARGET_AVX
+inline unsigned intersect_boxes_8_avx(const float* const near[3], const float* const far[3],
+                                      const ray_data& r, float tmin, float tmax, float* t_near) {
+    __m256 tn = _mm256_set1_ps(tmin);
+    __m256 tf = _mm256_set1_ps(tmax);
+    for (int axis = 0; axis < 3; axis++) {
+        __m256 origin = _mm256_set1_ps(r.origin[axis]);
+        __m256 inv = _mm256_set1_ps(r.inv_direction[axis]);
+        tn = _mm256_max_ps(tn, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near[axis]), origin), inv));
+        tf = _mm256_min_ps(tf, _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far[axis]), origin), inv));
+    }
+    _mm256_storeu_ps(t_near, tn);
+    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)));
+}
+#endif
+
+template <int Width>
+inline unsigned intersect_boxes(const wide_bvh_node<Width>& node, const ray_data& r, float tmin, float tmax, float* t_near) {
+    const float* near[3];
+    const float* far[3];
+    slab_planes(node, r, near, far);
+#if defined(BVH_X86)
+    if (Width == 8 && cpu_features::get().avx) {
+        return intersect_boxes_8_avx(near, far, r, tmin, tmax, t_near);
+    }
+#endif
+    unsigned mask = 0;
+    for (int offset = 0; offset < Width; offset += 4) {
+        mask |= intersect_boxes_4(near, far, offset, r, tmin, tmax, t_near) << offset;
+    }
+    return mask;
+}
+
+} // namespace wide_bvh_detail
+
+// BVH4 / BVH8 collapsed from a built binary bvh. Leaves and geometry stay in the source bvh,
+// which must outlive this object and not be rebuilt while it is in use.
+template <int Width>
+class wide_bvh {
+    static_assert(Width == 4 || Width == 8, "wide_bvh supports 4 and 8 children");
+
+public:
+    using node = wide_bvh_node<Width>;
+
+private:
+    const bvh& m_source;
+    std::vector<node, aligned_allocator<node, 32>> m_nodes;
+
+    struct traversal_entry {
+        uint32_t child;
+        uint32_t count;
+        float t_near;
+    };
+
+public:
+    explicit wide_bvh(const bvh& source): m_source(source) {
+        const bvh_node_array& binary = source.get();
+        m_nodes.reserve(binary.size() / (Width / 2) + 1);
+        collapse(0);
+    }
+
+    const std::vector<node, aligned_allocator<node, 32>>& nodes() const {
+        return m_nodes;
+    }
+
+    const bvh& source() const {
+        return m_source;
+    }
+
+    size_t memory_bytes() const {
+        return m_nodes.size() * sizeof(node);
+    }
+
+    // Closest hit in (r.tmin, r.tmax), children are visited front to back
+    bool intersect(const ray& r, hit_record& hit) const {
+        wide_bvh_detail::ray_data data(r);
+        float tmax = std::min(r.tmax, hit.t);
+        const std::vector<triangle>& triangles = m_source.triangles();
+        const std::vector<vector3>& vertices = m_source.vertices();
+        const std::vector<uint32_t>& indices = m_source.indices();
+
+        // Every level adds at most Width - 1 entries on top of the one it consumed
+        size_t capacity = m_source.depth() * (Width - 1) + Width;
+        traversal_entry local_stack[bvh::traversal_stack_size];
+        std::vector<traversal_entry> heap_stack;
+        traversal_entry* stack = local_stack;
+        if (capacity > bvh::traversal_stack_size) {
+            heap_stack.resize(capacity);
+            stack = heap_stack.data();
+        }
+
+        size_t size = 0;
+        stack[size++] = traversal_entry{0, 0, r.tmin};
+        bool found = false;
+        alignas(32) float t_near[Width];
+
+        while (size > 0) {
+            traversal_entry entry = stack[--size];
+            if (entry.t_near > tmax) {
+                continue;
+            }
+
+            if (entry.count > 0) {
+                for (uint32_t i = entry.child; i < entry.child + entry.count; i++) {
+                    const triangle& tri = triangles[i];
+                    float t, u, v;
+                    if (intersect_triangle(r, vertices[tri.vertices_ids[0]], vertices[tri.vertices_ids[1]],
+                                           vertices[tri.vertices_ids[2]], tmax, t, u, v)) {
+                        tmax = t;
+                        hit.t = t;
+                        hit.u = u;
+                        hit.v = v;
+                        hit.triangle = indices[i];
+                        found = true;
+                    }
+                }
+                continue;
+            }
+
+            const node& n = m_nodes[entry.child];
+            unsigned mask = wide_bvh_detail::intersect_boxes(n, data, r.tmin, tmax, t_near);
+
+            // Push the hit children far to near so the nearest one is popped first
+            size_t first = size;
+            for (int slot = 0; slot < Width; slot++) {
+                if (!(mask & (1u << slot))) {
+                    continue;
+                }
+                traversal_entry child{n.child[slot], n.count[slot], t_near[slot]};
+                size_t i = size++;
+                while (i > first && stack[i - 1].t_near < child.t_near) {
+                    stack[i] = stack[i - 1];
+                    i--;
+                }
+                stack[i] = child;
+            }
+        }
+
+        return found;
+    }
+
+private:
+    // Greedily opens the largest interior child until the node is full, depth-first node order
+    uint32_t collapse(uint32_t binary_index) {
+        const bvh_node_array& binary = m_source.get();
+        uint32_t index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+
+        uint32_t slots[Width];
+        int slot_count = 0;
+        if (binary[binary_index].is_leaf()) {
+            slots[slot_count++] = binary_index;
+        } else {
+            slots[slot_count++] = binary_index + 1;
+            slots[slot_count++] = binary[binary_index].offset;
+        }
+
+        while (slot_count < Width) {
+            int widest = -1;
+            float widest_area = -1.0f;
+            for (int i = 0; i < slot_count; i++) {
+                const linear_bvh_node& candidate = binary[slots[i]];
+                if (!candidate.is_leaf() && candidate.box().surface_area() > widest_area) {
+                    widest = i;
+                    widest_area = candidate.box().surface_area();
+                }
+            }
+            if (widest < 0) {
+                break;
+            }
+            uint32_t opened = slots[widest];
+            slots[widest] = opened + 1;
+            slots[slot_count++] = binary[opened].offset;
+        }
+
+        float inf = std::numeric_limits<float>::infinity();
+        for (int slot = 0; slot < Width; slot++) {
+            node& n = m_nodes[index];
+            if (slot >= slot_count) {
+                n.min_x[slot] = n.min_y[slot] = n.min_z[slot] = inf;
+                n.max_x[slot] = n.max_y[slot] = n.max_z[slot] = -inf;
+                n.child[slot] = node::empty_slot;
+                n.count[slot] = 0;
+                continue;
+            }
+
+            const linear_bvh_node& child = binary[slots[slot]];
+            n.min_x[slot] = child.min_corner.data[0];
+            n.min_y[slot] = child.min_corner.data[1];
+            n.min_z[slot] = child.min_corner.data[2];
+            n.max_x[slot] = child.max_corner.data[0];
+            n.max_y[slot] = child.max_corner.data[1];
+            n.max_z[slot] = child.max_corner.data[2];
+            n.count[slot] = child.count;
+            n.child[slot] = child.offset;
+        }
+
+        // Recurse after the slots are written, m_nodes may reallocate
+        for (int slot = 0; slot < slot_count; slot++) {
+            if (!binary[slots[slot]].is_leaf()) {
+                uint32_t child = collapse(slots[slot]);
+                m_nodes[index].child[slot] = child;
+            }
+        }
+
+        return index;
+    }
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
+
+#endif //BVH_WIDE_BVH_H
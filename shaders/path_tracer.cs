@@ -5,6 +5,7 @@ const float FLOAT_INF = 1e20f;
 
 layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
 layout(rgba32f, binding = 0) uniform image2D texture0;
+layout(r32ui, binding = 1) uniform uimage2D sample_count;
 
 uniform ivec2 resolution = ivec2(280,280);//ivec2(800, 600);
 
@@ -41,6 +42,63 @@ float Rand(inout uint state) {
     return RandFloat(RandUint(state));
 }
 
+// Low-discrepancy sampling: Owen-scrambled, shuffled Sobol points (Burley 2020) instead of the
+// xorshift white noise. sobol_directions holds the direction numbers of sobol_table (sampler.h),
+// dimension d, bit b at d * 32 + b. Dimensions come in groups of four, each group being a 4D Sobol
+// sequence with its own shuffle and scramble; the camera uses dimensions 0 and 1, bounce depth
+// scatters with group 2 * depth + 1 and samples a light with group 2 * depth + 2. Same numbers as
+// path_sampler with sampler_type::sobol.
+layout (std430, binding=5) buffer sobol_buffer { uint sobol_directions[]; };
+uniform bool sobol = false;
+
+const uint SOBOL_DIMENSIONS = 4u;
+
+struct Sampler {
+    uint state;         // xorshift state, sobol = false
+    uint seed;          // Hash(pixel index)
+    uint index;         // sample index of the pixel
+    uint dimension;
+};
+
+uint Sobol(uint index, uint dimension) {
+    uint x = 0u;
+    for (uint bit = 0u; index != 0u; bit++, index >>= 1u) {
+        if ((index & 1u) != 0u) {
+            x ^= sobol_directions[dimension * 32u + bit];
+        }
+    }
+    return x;
+}
+
+uint NestedUniformScramble(uint x, uint seed) {
+    x = bitfieldReverse(x);
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return bitfieldReverse(x);
+}
+
+uint HashCombine(uint seed, uint value) {
+    return seed ^ (Hash(value) + 0x9E3779B9u + (seed << 6u) + (seed >> 2u));
+}
+
+float SobolRand(uint pixel_seed, uint index, uint dimension) {
+    uint seed = HashCombine(pixel_seed, dimension / SOBOL_DIMENSIONS);
+    uint component = dimension % SOBOL_DIMENSIONS;
+    uint shuffled = NestedUniformScramble(index, seed);
+    uint x = NestedUniformScramble(Sobol(shuffled, component), HashCombine(seed, component));
+    return float(x >> 8u) * uintBitsToFloat(0x33800000u);      // 2^-24
+}
+
+float Rand(inout Sampler state) {
+    if (!sobol) {
+        return Rand(state.state);
+    }
+    return SobolRand(state.seed, state.index, state.dimension++);
+}
+
 vec3 CosineWeightedHemisphereSample(float u1, float u2) {
 	float cosTheta = sqrt(1.0f - u1);
 	float sinTheta = sqrt(u1);
@@ -64,7 +122,7 @@ vec3 IdealSpecularReflect(vec3 direction, vec3 normal) {
 }
 
 vec3 IdealSpecularTransmit(vec3 direction, vec3 normal, float n_out, float n_in,
-                           out float pr, inout uint state) {
+                           out float pr, inout Sampler state) {
 
 	vec3 d_Re = IdealSpecularReflect(direction, normal);
 
@@ -135,6 +193,8 @@ layout (std430, binding=1) buffer vertex_buffer { vec4 vertices[]; };
 layout (std430, binding=2) buffer index_buffer { vec4 indices[]; };
 layout (std430, binding=3) buffer emm_buffer { vec4 emissions[]; };
 layout (std430, binding=4) buffer color_buffer { vec4 colors[]; };
+// Number of entries in indices, set by init_scene() in main.cpp
+uniform int triangle_count = 0;
 
 struct HitInfo
 {
@@ -150,6 +210,21 @@ struct HitInfo
     int obj_index;
 };
 
+HitInfo TriangleHit(Ray ray, float t, vec3 edge1, vec3 edge2, int index)
+{
+    HitInfo obj_hit;
+    obj_hit.dist = t;
+    obj_hit.position = ray.origin + ray.direction * obj_hit.dist;
+    obj_hit.normal = normalize(cross(edge1, edge2));
+    obj_hit.transmitted = false;
+    obj_hit.emission = emissions[index].xyz;
+    obj_hit.color = vec3(0.5, 0.5, 0.1);
+    obj_hit.reflection_type = 1u;
+    obj_hit.ray = ray;
+    obj_hit.obj_index = index;
+    return obj_hit;
+}
+
 //Moller-Trumbore
 HitInfo FindHit(vec4 triangle, Ray ray)
 {
@@ -186,17 +261,87 @@ HitInfo FindHit(vec4 triangle, Ray ray)
         return obj_hit;
     }
 
-    obj_hit.dist = t;
-    obj_hit.position = ray.origin + ray.direction * obj_hit.dist;
-    obj_hit.normal = normalize(cross(edge1, edge2));
-    obj_hit.transmitted = false;
-    obj_hit.emission = vec3(1.0f);
-    obj_hit.color = vec3(0.5, 0.5, 0.1);
-    obj_hit.reflection_type = 1u;
-    obj_hit.ray = ray;
+    return TriangleHit(ray, t, edge1, edge2, int(triangle.w));
+}
 
-    return obj_hit;
+// Watertight test (Woop, Benthin and Wald 2013) instead of FindHit: no determinant epsilon, rays
+// through a shared edge or vertex cannot slip between the triangles. Same as triangle_test::watertight
+// of the CPU tracer.
+uniform bool watertight = false;
+
+// Per ray constants of the watertight test, computed once and used for every triangle:
+// kz is the axis of the largest direction component and shear maps the direction onto +z
+struct WatertightRay {
+    int kx;
+    int ky;
+    int kz;
+    vec3 shear;
+};
+
+WatertightRay PrepareWatertightRay(Ray ray)
+{
+    vec3 d = ray.direction;
+    int kz = 0;
+    if (abs(d.y) > abs(d[kz])) kz = 1;
+    if (abs(d.z) > abs(d[kz])) kz = 2;
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (d[kz] < 0.0f) {
+        int tmp = kx;
+        kx = ky;
+        ky = tmp;
+    }
+    return WatertightRay(kx, ky, kz, vec3(d[kx] / d[kz], d[ky] / d[kz], 1.0f / d[kz]));
+}
+
+HitInfo FindHitWatertight(vec4 triangle, Ray ray, WatertightRay w)
+{
+    float e = 1e-3;     // same t cutoff as FindHit
+    vec3 v0 = vertices[int(triangle.x)].xyz;
+    vec3 v1 = vertices[int(triangle.y)].xyz;
+    vec3 v2 = vertices[int(triangle.z)].xyz;
+    HitInfo obj_hit;
+
+    // Vertices relative to the origin, sheared so the ray runs along +z. precise keeps the compiler
+    // from fusing these differently for two triangles that share an edge.
+    precise vec3 a = v0 - ray.origin;
+    precise vec3 b = v1 - ray.origin;
+    precise vec3 c = v2 - ray.origin;
+    precise float ax = a[w.kx] - w.shear.x * a[w.kz];
+    precise float ay = a[w.ky] - w.shear.y * a[w.kz];
+    precise float bx = b[w.kx] - w.shear.x * b[w.kz];
+    precise float by = b[w.ky] - w.shear.y * b[w.kz];
+    precise float cx = c[w.kx] - w.shear.x * c[w.kz];
+    precise float cy = c[w.ky] - w.shear.y * c[w.kz];
+
+    precise float U = cx * by - cy * bx;
+    precise float V = ax * cy - ay * cx;
+    precise float W = bx * ay - by * ax;
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = float(double(cx) * double(by) - double(cy) * double(bx));
+        V = float(double(ax) * double(cy) - double(ay) * double(cx));
+        W = float(double(bx) * double(ay) - double(by) * double(ax));
+    }
 
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) {
+        obj_hit.dist = -2;
+        return obj_hit;
+    }
+
+    float det = U + V + W;
+    if (det == 0.0f) {
+        obj_hit.dist = -1;
+        return obj_hit;
+    }
+
+    // t = T / det, tested against the cutoff without the division
+    float T = U * (w.shear.z * a[w.kz]) + V * (w.shear.z * b[w.kz]) + W * (w.shear.z * c[w.kz]);
+    if (T * sign(det) <= e * abs(det)) {
+        obj_hit.dist = -4;
+        return obj_hit;
+    }
+
+    return TriangleHit(ray, T / det, v1 - v0, v2 - v0, int(triangle.w));
 }
 
 
@@ -363,19 +508,78 @@ Triangle triangles[12 + faces_count];
 //     triangles[12 + 30].emission = vec3(5.0f);
 // }
 
-vec3 CalculateRadiance(Ray ray, inout uint state) {
+// Next-event estimation: every diffuse vertex samples one emissive triangle and adds its light if
+// a shadow ray reaches it; a hit on an emitter right after a diffuse vertex then adds nothing.
+// lights is the alias table of light_table (light_table.h), light_count its size.
+struct LightEntry {
+    float probability;
+    uint alias;
+    uint triangle;
+    float pdf;          // per unit area
+};
+
+layout (std430, binding=6) buffer light_buffer { LightEntry lights[]; };
+uniform bool next_event = false;
+uniform int light_count = 0;
+
+bool Occluded(Ray ray, float tmax) {
+    WatertightRay w = PrepareWatertightRay(ray);
+    for (int i = 0; i < triangle_count; i++) {
+        HitInfo info = watertight ? FindHitWatertight(indices[i], ray, w) : FindHit(indices[i], ray);
+        if (info.dist > 0 && info.dist < tmax) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Emission from one point on one light reaching the diffuse vertex p (w: normal on the side of the
+// incoming ray), times cos / PI over the pdf of the point. Emitters are two-sided, as in TriangleHit.
+vec3 SampleLight(vec3 p, vec3 w, inout Sampler state) {
+    float scaled = Rand(state) * float(light_count);
+    uint i = min(uint(scaled), uint(light_count - 1));
+    LightEntry light = (scaled - float(i) < lights[i].probability) ? lights[i] : lights[lights[i].alias];
+    float su = sqrt(Rand(state));
+    float u2 = Rand(state);
+
+    vec4 triangle = indices[light.triangle];
+    vec3 v0 = vertices[int(triangle.x)].xyz;
+    vec3 v1 = vertices[int(triangle.y)].xyz;
+    vec3 v2 = vertices[int(triangle.z)].xyz;
+    vec3 q = v0 * (1.0f - su) + v1 * (su * (1.0f - u2)) + v2 * (su * u2);
+    vec3 nl = normalize(cross(v1 - v0, v2 - v0));
+
+    vec3 d = q - p;
+    float dist2 = dot(d, d);
+    float dist = sqrt(dist2);
+    d /= dist;
+    float cos_p = dot(w, d);
+    float cos_l = abs(dot(nl, d));
+    if (!(cos_p > 0.0f && cos_l > 0.0f)) {
+        return vec3(0.0f);
+    }
+    if (Occluded(Ray(p, d, EPSILON, FLOAT_INF, 0u), dist - 1e-3f)) {
+        return vec3(0.0f);
+    }
+    return emissions[light.triangle].xyz * (cos_p * cos_l / (PI * dist2 * light.pdf));
+}
+
+vec3 CalculateRadiance(Ray ray, inout Sampler state) {
     Ray  r = Ray(ray.origin, ray.direction, ray.tmin, ray.tmax, ray.depth);
 
     vec3 L = vec3(0.0f);
     vec3 F = vec3(1.0f);
+    bool nee = next_event && light_count > 0;
+    bool count_emission = true;
 
     while (true){
         int i = 0;
         HitInfo info;
         HitInfo min_info;
         min_info.dist = 999999999;
-        while(i < 12 + faces_count){
-            info =  FindHit(indices[i], r);
+        WatertightRay w = PrepareWatertightRay(r);
+        while(i < triangle_count){
+            info = watertight ? FindHitWatertight(indices[i], r, w) : FindHit(indices[i], r);
             if (info.dist > 0){
                 if (info.dist < min_info.dist){
                 min_info = info;
@@ -385,9 +589,13 @@ vec3 CalculateRadiance(Ray ray, inout uint state) {
         }
         info = min_info;
         if ((info.dist < 0.0f) || (info.dist > 999999997)){
-            return vec3(0);
+            // Without next-event estimation a path that leaves the scene drops what it gathered
+            return nee ? L : vec3(0);
+        }
+        state.dimension = SOBOL_DIMENSIONS * (2u * r.depth + 1u);
+        if (count_emission) {
+            L += F * info.emission;
         }
-        L += F * info.emission;
         F *= info.color;
         if (4u < r.depth){
                     float continue_probability = Max(info.color);
@@ -398,6 +606,7 @@ vec3 CalculateRadiance(Ray ray, inout uint state) {
                 }
         vec3 n  = info.normal;
         vec3 p = info.position;
+        count_emission = true;
                 switch (info.reflection_type) {
 
                     case REFLECTION_SPECULAR: {
@@ -420,6 +629,11 @@ vec3 CalculateRadiance(Ray ray, inout uint state) {
                         vec3 v = cross(w, u);
                         vec3 sample_d = CosineWeightedHemisphereSample(Rand(state), Rand(state));
                         vec3 d = normalize(sample_d.x * u + sample_d.y * v + sample_d.z * w);
+                        if (nee) {
+                            state.dimension = SOBOL_DIMENSIONS * (2u * r.depth + 2u);
+                            L += F * SampleLight(p, w, state);
+                            count_emission = false;
+                        }
                         r = Ray(p, d, EPSILON, FLOAT_INF, r.depth + 1u);
                         break;
                     }
@@ -492,7 +706,7 @@ vec3 CalculateRadiance(Ray ray, inout uint state) {
 //     }
 }
 
-vec3 CalculateRadiance(vec2 fragCoord, inout uint state) {
+vec3 CalculateRadiance(vec2 fragCoord, inout Sampler state) {
 	vec3  camera_direction = normalize(vec3(0.0f, 0.1f, -1.0f));
 	vec3  camera_x = vec3(resolution.x * FOV / resolution.y, 0.0f, 0.0f);
 	vec3  camera_y = normalize(cross(camera_x, camera_direction)) * FOV;
@@ -504,15 +718,56 @@ vec3 CalculateRadiance(vec2 fragCoord, inout uint state) {
 }
 
 
+// Adaptive sampling: texture0 keeps the mean radiance of a pixel's own samples in rgb and the mean
+// squared luminance in a, sample_count how many it took. A pixel stops sampling once the relative
+// standard error of its mean luminance is below error_threshold, within [min_spp, max_spp] samples.
+uniform bool adaptive = false;
+uniform int min_spp = 16;
+uniform int max_spp = 1024;
+uniform float error_threshold = 0.05f;
+
+float Luminance(vec3 c) {
+    return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+bool Converged(vec4 accumulated, uint samples) {
+    if (int(samples) < max(min_spp, 2)) {
+        return false;
+    }
+    if (int(samples) >= max_spp) {
+        return true;
+    }
+    float n = float(samples);
+    float mean = Luminance(accumulated.rgb);
+    float variance = max(accumulated.a - mean * mean, 0.0f) * n / (n - 1.0f);
+    return sqrt(variance / n) < error_threshold * max(mean, 1e-3f);
+}
+
 void main() {
     ivec2 fragCoord = ivec2(gl_GlobalInvocationID.xy);
 
+    vec4  accumulated = imageLoad(texture0, fragCoord);
+    uint  samples = imageLoad(sample_count, fragCoord).x;
+    if (adaptive && Converged(accumulated, samples)) {
+        return;
+    }
+
     uint  index = uint(fragCoord.y * resolution.x + fragCoord.x);
     uint  key = index ^ floatBitsToUint(time);
-    uint  state = Hash(key);
+    Sampler state = Sampler(Hash(key), Hash(index), adaptive ? samples : uint(frame - 1), 0u);
 
     vec3  hdr = CalculateRadiance(fragCoord, state);
-    vec3  mean = imageLoad(texture0, fragCoord).xyz;
+    if (adaptive) {
+        float n = float(samples + 1u);
+        float l = Luminance(hdr);
+        accumulated += (vec4(hdr, l * l) - accumulated) / n;
+        // Alpha is the second moment, not coverage: this relies on screen_quad.fs writing alpha 1
+        imageStore(texture0, fragCoord, accumulated);
+        imageStore(sample_count, fragCoord, uvec4(samples + 1u));
+        return;
+    }
+
+    vec3  mean = accumulated.xyz;
     mean += (hdr - mean) / float(frame + 1);
 
     vec4 color = vec4(mean, 1.0f);
@@ -0,0 +1,188 @@
+//
+// Created by mykola on 02.06.24.
+//
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bvh_stats.h"
+#include "compressed_bvh.h"
+#include "dynamic_bvh.h"
+#include "scene.h"
+#include "wide_bvh.h"
+
+struct builder {
+    std::string name;
+    std::function<void(bvh&)> build;
+};
+
+static std::vector<builder> builders() {
+    bvh_build_options median;
+    bvh_build_options sah;
+    sah.split_method = bvh_split_method::sah;
+    bvh_build_options sbvh;
+    sbvh.split_method = bvh_split_method::sbvh;
+    bvh_build_options lbvh63;
+    lbvh63.morton_bits = 63;
+
+    return {
+        {"median", [median](bvh& b) { b.build(median); }},
+        {"sah", [sah](bvh& b) { b.build(sah); }},
+        {"sbvh", [sbvh](bvh& b) { b.build(sbvh); }},
+        {"lbvh30", [median](bvh& b) { b.build_lbvh(median); }},
+        {"lbvh63", [lbvh63](bvh& b) { b.build_lbvh(lbvh63); }},
+        {"median+treelets", [median](bvh& b) { b.build(median); b.optimize(); }},
+        {"lbvh30+treelets", [median](bvh& b) { b.build_lbvh(median); b.optimize(); }},
+    };
+}
+
+static std::string histogram(const std::vector<size_t>& counts) {
+    std::string line;
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] > 0) {
+            line += " " + std::to_string(i) + ":" + std::to_string(counts[i]);
+        }
+    }
+    return line;
+}
+
+static void report(const std::string& filename) {
+    scene s(filename);
+    std::cout << filename << ": " << s.get_triangles().size() << " triangles" << std::endl;
+
+    for (const auto& b : builders()) {
+        bvh tree = s.get_bvh();
+        auto start = std::chrono::steady_clock::now();
+        b.build(tree);
+        double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        bvh_stats stats = compute_bvh_stats(tree);
+        bvh8 wide(tree);
+        compressed_bvh<8> compressed(wide);
+
+        std::printf("  %-16s build %8.2f ms  SAH %7.2f  EPO %7.3f  nodes %7zu  leaves %7zu  refs %.2fx\n",
+                    b.name.c_str(), build_ms, stats.sah_cost, stats.end_point_overlap, stats.node_count,
+                    stats.leaf_count, stats.duplication_ratio);
+        std::printf("  %-16s memory %zu KB (bvh8 nodes %zu KB, compressed %zu KB)\n", "",
+                    stats.memory_bytes / 1024, wide.memory_bytes() / 1024, compressed.memory_bytes() / 1024);
+        std::printf("  %-16s leaf depth:%s\n", "", histogram(stats.depth_histogram).c_str());
+        std::printf("  %-16s leaf size:%s\n", "", histogram(stats.leaf_size_histogram).c_str());
+    }
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Moves k% of the triangles of a dynamic_bvh (remove, then insert a copy shifted by up to 30% of the scene
+// extent) and compares it with a binned SAH build of the moved mesh: time, SAH cost and closest hits
+static void report_dynamic(const std::string& filename) {
+    scene s(filename);
+    size_t n = s.get_triangles().size();
+    std::cout << filename << ": " << n << " triangles, dynamic_bvh against a rebuild" << std::endl;
+
+    // One triangle per leaf, the layout of dynamic_bvh, so the SAH costs are comparable
+    bvh_build_options sah;
+    sah.split_method = bvh_split_method::sah;
+    sah.max_leaf_size = 1;
+    bvh base = s.get_bvh();
+    base.build(sah);
+    aabb bounds = base.get()[0].box();
+    vector3 extent = bounds.max_corner - bounds.min_corner;
+
+    for (double fraction : {0.001, 0.01, 0.05, 0.1, 0.25, 0.5}) {
+        dynamic_bvh tree(base);
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> shift(-0.3f, 0.3f);
+
+        size_t k = std::max<size_t>(1, static_cast<size_t>(fraction * n));
+        std::vector<uint32_t> ids(n);
+        for (uint32_t i = 0; i < n; i++) {
+            ids[i] = i;
+        }
+        std::shuffle(ids.begin(), ids.end(), rng);
+        ids.resize(k);
+
+        std::vector<std::array<vector3, 3>> moved;
+        for (uint32_t id : ids) {
+            vector3 offset{shift(rng) * extent.data[0], shift(rng) * extent.data[1], shift(rng) * extent.data[2]};
+            const triangle& tri = tree.get_triangle(id);
+            moved.push_back({{tree.vertices()[tri.vertices_ids[0]] + offset, tree.vertices()[tri.vertices_ids[1]] + offset,
+                              tree.vertices()[tri.vertices_ids[2]] + offset}});
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < k; i++) {
+            tree.remove(ids[i]);
+            tree.insert(moved[i][0], moved[i][1], moved[i][2]);
+        }
+        double dynamic_ms = elapsed_ms(start);
+
+        // The same moved mesh, built from scratch
+        std::vector<vec3> vertices;
+        for (const vector3& v : tree.vertices()) {
+            vertices.emplace_back(v.data[0], v.data[1], v.data[2]);
+        }
+        std::vector<triangle> triangles;
+        for (uint32_t id = 0; id < n + k; id++) {
+            if (tree.contains(id)) {
+                triangles.push_back(tree.get_triangle(id));
+            }
+        }
+        bvh rebuilt(triangles, vertices);
+        start = std::chrono::steady_clock::now();
+        rebuilt.build(sah);
+        double rebuild_ms = elapsed_ms(start);
+
+        // Rays from around the scene towards points in it, triangle ids differ between the trees so the distances are compared
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        vector3 center = bounds.centroid();
+        float radius = std::sqrt(extent.dot(extent));
+        size_t mismatches = 0;
+        const size_t ray_count = 10000;
+        for (size_t i = 0; i < ray_count; i++) {
+            vector3 origin{center.data[0] + radius * (2.0f * unit(rng) - 1.0f), center.data[1] + radius * (2.0f * unit(rng) - 1.0f),
+                           center.data[2] + radius * (2.0f * unit(rng) - 1.0f)};
+            vector3 target{bounds.min_corner.data[0] + extent.data[0] * unit(rng), bounds.min_corner.data[1] + extent.data[1] * unit(rng),
+                           bounds.min_corner.data[2] + extent.data[2] * unit(rng)};
+            ray r(origin, (target - origin).normalize(), 1e-3f);
+            hit_record a, b;
+            if (tree.intersect(r, a) != rebuilt.intersect(r, b) || a.t != b.t) {
+                mismatches++;
+            }
+        }
+
+        std::printf("  moved %5.1f%% (%6zu)  dynamic %8.2f ms  rebuild %8.2f ms  SAH dynamic %7.2f  rebuild %7.2f  hit mismatches %zu / %zu\n",
+                    100.0 * fraction, k, dynamic_ms, rebuild_ms, tree.sah_cost(), rebuilt.sah_cost(), mismatches, ray_count);
+    }
+}
+
+int main(int argc, char** argv) {
+    bool dynamic = argc > 1 && std::string(argv[1]) == "--dynamic";
+    int first = dynamic ? 2 : 1;
+    if (argc <= first) {
+        std::cerr << "Usage: " << argv[0] << " [--dynamic] <mesh.obj> [more.obj ...]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        for (int i = first; i < argc; i++) {
+            if (dynamic) {
+                report_dynamic(argv[i]);
+            } else {
+                report(argv[i]);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
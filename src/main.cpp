@@ -9,6 +9,7 @@
 #include "shader.h"
 #include "compute_shader.h"
 
+#include "sampler.h"
 #include "scene.h"
 
 #define SCR_WIDTH 280
@@ -45,10 +46,24 @@ void render_quad() {
 
 const unsigned int TEXTURE_WIDTH = SCR_WIDTH, TEXTURE_HEIGHT = SCR_HEIGHT;
 
+// Adaptive sampling in path_tracer.cs: converged pixels stop taking samples
+const bool ADAPTIVE_SAMPLING = false;
+const int ADAPTIVE_MIN_SPP = 16;
+const int ADAPTIVE_MAX_SPP = 4096;
+const float ADAPTIVE_ERROR_THRESHOLD = 0.02f;
+
+// Owen-scrambled Sobol points instead of white noise in path_tracer.cs
+const bool SOBOL_SAMPLER = false;
+
+// Next-event estimation in path_tracer.cs: diffuse vertices sample a light from the alias table at binding 6
+const bool NEXT_EVENT_ESTIMATION = false;
+
 GLuint verticesSSBO;
 GLuint trianglesSSBO;
 GLuint emissionSSBO;
 GLuint colorSSBO;
+GLuint sobolSSBO;
+GLuint lightSSBO;
 
 struct glsl_vec {
     glm::vec4 pos;
@@ -96,12 +111,16 @@ void ssbo_trinagles(const scene& s) {
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-void ssbo_emission(const scene& s) {
-    int triangles_size = s.get_triangles().size();
+// Every triangle emits 1, as TriangleHit did before it read emm_buffer
+std::vector<vector3> triangle_emissions(const scene& s) {
+    return std::vector<vector3>(s.get_triangles().size(), vector3{1.0f, 1.0f, 1.0f});
+}
+
+void ssbo_emission(const std::vector<vector3>& emissions) {
     std::vector<glsl_emission> glsl_emission;
 
-    for (int i = 0; i < triangles_size; i++) {
-        glsl_emission.push_back({glm::vec4(0)});
+    for (const auto& e : emissions) {
+        glsl_emission.push_back({glm::vec4(e.data[0], e.data[1], e.data[2], 0)});
     }
 
     glGenBuffers(1, &emissionSSBO);
@@ -126,12 +145,42 @@ void ssbo_color(const scene& s) {
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-int init_scene(const std::string& filename) {
+void ssbo_sobol() {
+    const sobol_table& table = sobol_table::get();
+
+    glGenBuffers(1, &sobolSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sobolSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(table.directions), table.directions, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, sobolSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Uploads the alias table of the emissive triangles, returns the number of lights
+int ssbo_lights(const scene& s, const std::vector<vector3>& emissions) {
+    light_table lights = s.get_light_table(emissions);
+
+    glGenBuffers(1, &lightSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightSSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, lights.size() * sizeof(light_entry), lights.entries().data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, lightSSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    return static_cast<int>(lights.size());
+}
+
+int init_scene(const std::string& filename, const compute_shader& cs) {
     scene s(filename);
     ssbo_vertices(s);
     ssbo_trinagles(s);
 
-    return s.get_triangles().size();
+    std::vector<vector3> emissions = triangle_emissions(s);
+    ssbo_emission(emissions);
+    int triangle_count = s.get_triangles().size();
+    cs.use();
+    cs.set_int("triangle_count", triangle_count);
+    cs.set_int("light_count", ssbo_lights(s, emissions));
+
+    return triangle_count;
 }
 
 int main()
@@ -183,10 +232,29 @@ int main()
 
     glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
+    // Samples taken per pixel, starts at 0
+    unsigned int sample_count;
+    std::vector<GLuint> zeros(TEXTURE_WIDTH * TEXTURE_HEIGHT, 0);
+    glGenTextures(1, &sample_count);
+    glBindTexture(GL_TEXTURE_2D, sample_count);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, TEXTURE_WIDTH, TEXTURE_HEIGHT, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, zeros.data());
+    glBindImageTexture(1, sample_count, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+
+    cs.use();
+    cs.set_int("adaptive", ADAPTIVE_SAMPLING);
+    cs.set_int("min_spp", ADAPTIVE_MIN_SPP);
+    cs.set_int("max_spp", ADAPTIVE_MAX_SPP);
+    cs.set_float("error_threshold", ADAPTIVE_ERROR_THRESHOLD);
+    cs.set_int("sobol", SOBOL_SAMPLER);
+    cs.set_int("next_event", NEXT_EVENT_ESTIMATION);
+    ssbo_sobol();
+
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
 
-    int faces = init_scene("../resources/cornell-box.obj");
+    int faces = init_scene("../resources/cornell-box.obj", cs);
     std::cout << faces;
 
     int cnt = 0;
@@ -213,6 +281,7 @@ int main()
     }
 
     glDeleteTextures(1, &texture);
+    glDeleteTextures(1, &sample_count);
     glDeleteProgram(s.id);
     glDeleteProgram(cs.id);
 